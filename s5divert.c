@@ -10,17 +10,27 @@
 #include <linux/errno.h>
 #include <linux/printk.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/notifier.h>
 
 /* Concurrency & timing */
 #include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
 #include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
 #include <linux/workqueue.h>
+#include <linux/async.h>
+#include <linux/completion.h>
 
 /* Power management */
 #include <linux/reboot.h>
 #include <linux/freezer.h>
 #include <linux/suspend.h>
 #include <linux/pm_wakeup.h>
+#include <linux/syscore_ops.h>
 
 /* Interfaces */
 #include <linux/fs.h>
@@ -31,6 +41,7 @@
 #include <linux/syscalls.h>
 #include <linux/uaccess.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/kobject.h>
 #include <linux/sysfs.h>
 
@@ -38,127 +49,2182 @@
 #include <linux/acpi.h>
 #include <acpi/acpi_bus.h>
 
+/* Platform */
+#include <linux/dmi.h>
+#include <linux/list.h>
+#include <linux/power_supply.h>
+#include <linux/efi.h>
+#include <linux/rtc.h>
+#include <linux/leds.h>
+#include <linux/input.h>
+#include <linux/pci.h>
+#include <linux/platform_device.h>
+
+#define CREATE_TRACE_POINTS
+#include "s5divert_trace.h"
+
 static struct sys_off_handler *sysoff_hook_h = NULL;
 
-static u8   param_s5divert_enabled = 1;
+/* Diversion modes, as used by the "enabled" parameter */
+#define S5DIVERT_MODES 6
+static const char * const mode_names[S5DIVERT_MODES] = { "disabled", "S4", "S3", "reboot", "kexec", "S3S4" };
+
+static const char * const mode_descs[S5DIVERT_MODES] = { "S5", "S4", "S3", "system reboot", "kexec reboot", "S3, then S4" };
+
+/*
+ * Instead of a fixed mode, "enabled" may hold a policy picking the mode by
+ * power source at the time of diversion, e.g. ac=S3,battery=S4,low=reboot,below=10
+ */
+struct power_policy {
+	bool active;
+	u8 ac;
+	u8 battery;
+	u8 low;		// on battery below "below" percent
+	u8 below;
+};
+
+enum { SYNC_NONE, SYNC_ROOT, SYNC_ALL };
+static const char * const sync_modes[] = { "none", "root", "all" };
+
+/* How diverted reboots reset the platform; all but "restart" skip a second device_shutdown() */
+enum { RESET_RESTART, RESET_ACPI, RESET_EFI, RESET_EMERGENCY };
+static const char * const reset_methods[] = { "restart", "acpi", "efi", "emergency" };
+
+#define WAKE_LIST_LEN 128
+
+/* Modes to step through, in order, when a diversion fails or runs out of time */
+#define FALLBACK_LEN 5
+
+struct fallback_list {
+	u8 count;
+	u8 modes[FALLBACK_LEN];
+};
+
+/*
+ * Everything that shapes a diversion lives in one struct. Writers copy it,
+ * modify the copy and publish it under config_lock. The sys-off callback
+ * and the triggers only take a snapshot under RCU and never wait for them.
+ */
+struct s5divert_config {
+	struct rcu_head rcu;
+	u8 mode;
+	struct power_policy policy;
+	u8 sync;
+	u8 reset_method;
+	bool wake_parallel;
+	/* Reset the platform from the syscore resume hook after stroff, before devices resume */
+	bool stroff_fast;
+	/* Keep the timeline, wake reasons and stroff statistics in EFI variables across reboots */
+	bool efi_records;
+	/* Settle delays (ms) along the diversion path; all of them default to not waiting at all */
+	unsigned int dsw_delay_ms;
+	unsigned int prep_delay_ms;
+	unsigned int sync_delay_ms;
+	unsigned int reboot_delay_ms;
+	unsigned int stroff_delay_ms;
+	/* Max. time (ms) to wait for the lid to close before diverting to S4/S3, 0 for not waiting */
+	unsigned int lid_wait_ms;
+	/* Hours in S3 before an RTC alarm sends the system to S4 (enabled=5) */
+	unsigned int s3s4_hours;
+	/* Time budget (ms) for the whole diversion, 0 for none */
+	unsigned int deadline_ms;
+	struct fallback_list fallback;
+	/* Wakeup devices to arm (allow) or not to arm (deny) regardless of /proc/acpi/wakeup */
+	char wake_allow[WAKE_LIST_LEN];
+	char wake_deny[WAKE_LIST_LEN];
+};
+
+static struct s5divert_config config_initial = {
+	.mode = 1,
+	.sync = SYNC_ALL,
+	.s3s4_hours = 2,
+};
+
+static struct s5divert_config __rcu *config = RCU_INITIALIZER(&config_initial);
+static DEFINE_MUTEX(config_lock);
+
+/* Set once a diversion has started, so that it happens only once */
+static atomic_t diverting = ATOMIC_INIT(0);
+
 static bool param_s5divert_poweroff = false;
 static bool param_s5divert_reboot = false;
 static bool param_s5divert_stroff = false;
 
-static bool lid_found = false;
+static bool lid_found = false;
+
+static struct proc_dir_entry *proc_dir_s5divert = NULL;
+static struct proc_dir_entry *proc_file_s5divert_enabled = NULL;
+static struct proc_dir_entry *proc_file_s5divert_poweroff = NULL;
+static struct proc_dir_entry *proc_file_s5divert_reboot = NULL;
+static struct proc_dir_entry *proc_file_s5divert_stroff = NULL;
+static struct proc_dir_entry *proc_file_s5divert_wakeup_devices = NULL;
+
+static struct kobject *sysfs_dir_s5divert = NULL;
+
+static struct workqueue_struct *wq = NULL;
+static void wq_worker(struct work_struct *work);
+static DECLARE_WORK(wq_work, wq_worker);
+
+/* Triggers run on wq, the writer only queues them and can follow them through trigger_status */
+enum { TRIGGER_POWEROFF, TRIGGER_REBOOT, TRIGGER_STROFF };
+static const char * const trigger_names[] = { "poweroff", "reboot", "stroff" };
+
+enum { TRIGGER_IDLE, TRIGGER_QUEUED, TRIGGER_RUNNING, TRIGGER_FAILED, TRIGGER_CLOSED };
+static const char * const trigger_states[] = { "idle", "queued", "running", "failed", "closed" };
+
+static DEFINE_SPINLOCK(trigger_lock);
+static u8 trigger_state = TRIGGER_IDLE;
+static u8 trigger_which;
+static int trigger_rc;
+
+/* The last error the module ran into, as shown by the status attribute */
+static DEFINE_SPINLOCK(status_lock);
+static const char *status_error_what = NULL;
+static int status_error_rc = 0;
+
+/* Wakes up poll() on status and tells udev, for anything that status shows */
+static void status_changed(void)
+{
+	if (!sysfs_dir_s5divert) return;
+	sysfs_notify(sysfs_dir_s5divert, NULL, "status");
+	kobject_uevent(sysfs_dir_s5divert, KOBJ_CHANGE);
+}
+
+static void status_error(const char *what, int rc)
+{
+	spin_lock(&status_lock);
+	status_error_what = what;
+	status_error_rc = rc;
+	spin_unlock(&status_lock);
+	status_changed();
+}
+
+static void system_poweroff(void);
+static void system_reboot(bool hard);
+static void system_reset(u8 method);
+static void sysoff_hook_apply(const struct s5divert_config *old, const struct s5divert_config *c);
+static bool wake_reason_latched(const char *name);
+static bool wake_reason_cleared(const char *name);
+
+static void config_get(struct s5divert_config *dst)
+{
+	rcu_read_lock();
+	*dst = *rcu_dereference(config);
+	rcu_read_unlock();
+}
+
+/*
+ * Every write to an EFI variable wears the flash behind it, and a machine
+ * cycling through stroff would write several of them each time. So records
+ * that are only there to be looked at are written with efi_records=1 only.
+ * Deleting them, and the S3S4 deadline enabled=5 depends on, is not held up.
+ */
+static bool efi_records_enabled(void)
+{
+	bool on;
+
+	rcu_read_lock();
+	on = rcu_dereference(config)->efi_records;
+	rcu_read_unlock();
+	return on;
+}
+
+/* Returns a private copy of the current config to modify, holding config_lock */
+static struct s5divert_config *config_begin(void)
+{
+	struct s5divert_config *c;
+
+	mutex_lock(&config_lock);
+	c = kmemdup(rcu_dereference_protected(config, lockdep_is_held(&config_lock)), sizeof(*c), GFP_KERNEL);
+	if (!c) mutex_unlock(&config_lock);
+	return c;
+}
+
+static void config_abort(struct s5divert_config *c)
+{
+	kfree(c);
+	mutex_unlock(&config_lock);
+}
+
+static void config_commit(struct s5divert_config *c)
+{
+	struct s5divert_config *old = rcu_dereference_protected(config, lockdep_is_held(&config_lock));
+
+	rcu_assign_pointer(config, c);
+	sysoff_hook_apply(old, c);
+	mutex_unlock(&config_lock);
+	if (old != &config_initial) kfree_rcu(old, rcu);
+	status_changed();
+}
+
+static void settle(const char *step, unsigned int ms)
+{
+	if (!ms) return;
+	pr_debug("s5divert: Settling for %ums (%s)\n", ms, step);
+	msleep(ms);
+}
+
+static int acpi_call_dsw_or_psw(acpi_handle handle, bool dsw, u8 enable, u8 sstate, u8 dstate, unsigned int delay_ms)
+{
+    if (dsw) {
+        union acpi_object in[3] = {
+            { .type = ACPI_TYPE_INTEGER, .integer.value = enable },  // 1 = enable
+            { .type = ACPI_TYPE_INTEGER, .integer.value = sstate  }, // e.g. ACPI_STATE_S4
+            { .type = ACPI_TYPE_INTEGER, .integer.value = dstate  }, // e.g. D3hot
+        };
+        struct acpi_object_list args = { .count = 3, .pointer = in };
+	    pr_debug("s5divert: Calling _DSW\n");
+		settle("_DSW", delay_ms);
+        return ACPI_SUCCESS(acpi_evaluate_object(handle, "_DSW", &args, NULL)) ? 0 : -EIO;
+    }
+    pr_debug("s5divert: Calling _PSW\n");
+    return ACPI_SUCCESS(acpi_execute_simple_method(handle, "_PSW", enable)) ? 0 : -EIO;
+}
+
+static const struct acpi_device_id lid_ids[] = {
+    { "PNP0C0D", 0 },     /* ACPI Lid device */
+    { }
+};
+
+static bool is_lid_device(struct acpi_device *adev)
+{
+    return acpi_match_device_ids(adev, lid_ids) == 0;
+}
+
+static bool mode_is_sleep(u8 mode)
+{
+	return mode == 1 || mode == 2 || mode == 5;
+}
+
+static int mode_parse(const char *s, u8 *mode)
+{
+	int i;
+
+	if (!kstrtou8(s, 0, mode)) return *mode < S5DIVERT_MODES ? 0 : -ERANGE;
+	if (!strcasecmp(s, "S5")) {
+		*mode = 0;
+		return 0;
+	}
+	for (i = 0; i < S5DIVERT_MODES; i++) {
+		if (!strcasecmp(s, mode_names[i])) {
+			*mode = i;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+/*
+ * Calls fn for every "key=value" token in buf, separated by white space.
+ * buf is modified. A token without '=' is passed with an empty value.
+ */
+static int kv_parse(char *buf, int (*fn)(const char *key, char *val, void *ctx), void *ctx)
+{
+	char *tok, *val;
+	int ret;
+
+	while ((tok = strsep(&buf, " \t\n"))) {
+		if (!*tok) continue;
+		val = strchr(tok, '=');
+		if (val) *val++ = '\0';
+		else val = tok + strlen(tok);
+		ret = fn(tok, val, ctx);
+		if (ret) return ret;
+	}
+	return 0;
+}
+
+static int power_policy_parse_kv(const char *key, char *val, void *ctx)
+{
+	struct power_policy *pp = ctx;
+
+	if (!strcmp(key, "ac")) return mode_parse(val, &pp->ac);
+	if (!strcmp(key, "battery")) return mode_parse(val, &pp->battery);
+	if (!strcmp(key, "low")) return mode_parse(val, &pp->low);
+	if (!strcmp(key, "below")) {
+		int ret = kstrtou8(val, 10, &pp->below);
+		if (ret) return ret;
+		return pp->below <= 100 ? 0 : -ERANGE;
+	}
+	return -EINVAL;
+}
+
+/* Accepts either a plain mode (number or name) or a power policy */
+static int enabled_parse(const char *buf, u8 *mode, struct power_policy *pp)
+{
+	char kbuf[64], *p;
+	int ret;
+
+	if (strscpy(kbuf, buf, sizeof(kbuf)) < 0) return -E2BIG;
+	p = strim(kbuf);
+	memset(pp, 0, sizeof(*pp));
+	*mode = 0;
+
+	if (!strchr(p, '=')) return mode_parse(p, mode);
+
+	strreplace(p, ',', ' ');
+	ret = kv_parse(p, power_policy_parse_kv, pp);
+	if (ret) return ret;
+	pp->active = pp->ac || pp->battery || pp->low;
+	return 0;
+}
+
+static int enabled_show(char *buf, size_t size)
+{
+	struct power_policy pp;
+	u8 mode;
+
+	rcu_read_lock();
+	mode = rcu_dereference(config)->mode;
+	pp = rcu_dereference(config)->policy;
+	rcu_read_unlock();
+
+	if (!pp.active) return scnprintf(buf, size, "%u\n", mode);
+	return scnprintf(buf, size, "ac=%s,battery=%s,low=%s,below=%u\n",
+		mode_names[pp.ac], mode_names[pp.battery], mode_names[pp.low], pp.below);
+}
+
+static int enabled_set(u8 mode, const struct power_policy *pp)
+{
+	struct s5divert_config *c = config_begin();
+
+	if (!c) return -ENOMEM;
+	c->policy = *pp;
+	c->mode = pp->active ? 0 : mode;
+	config_commit(c);
+	return 0;
+}
+
+static bool divert_configured(const struct s5divert_config *c)
+{
+	return c->policy.active || c->mode != 0;
+}
+
+static int battery_capacity_cb(struct device *dev, void *data)
+{
+	struct power_supply *psy = dev_get_drvdata(dev);
+	union power_supply_propval val;
+	int *sum = data;	// sum[0]: capacity, sum[1]: batteries
+
+	if (!psy || psy->desc->type != POWER_SUPPLY_TYPE_BATTERY) return 0;
+	// Skip batteries of mice, keyboards and the like
+	if (!power_supply_get_property(psy, POWER_SUPPLY_PROP_SCOPE, &val) && val.intval == POWER_SUPPLY_SCOPE_DEVICE) return 0;
+	if (power_supply_get_property(psy, POWER_SUPPLY_PROP_CAPACITY, &val)) return 0;
+	sum[0] += val.intval;
+	sum[1]++;
+	return 0;
+}
+
+/* Average capacity of all system batteries in percent, or -1 if there are none */
+static int battery_capacity(void)
+{
+	int sum[2] = { 0, 0 };
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	power_supply_for_each_device(sum, battery_capacity_cb);
+#else
+	class_for_each_device(power_supply_class, NULL, sum, battery_capacity_cb);
+#endif
+	return sum[1] ? sum[0] / sum[1] : -1;
+}
+
+/* Resolves the configured mode, asking the power supplies right now if there's a policy */
+static u8 divert_mode_resolve(const struct s5divert_config *c)
+{
+	const struct power_policy *pp = &c->policy;
+	int supplied, capacity;
+	u8 mode;
+
+	if (!pp->active) return c->mode;
+
+	// No power supply information at all? Then it is not a battery powered device.
+	supplied = power_supply_is_system_supplied();
+	capacity = battery_capacity();
+	if (supplied != 0) mode = pp->ac;
+	else if (pp->below && capacity >= 0 && capacity < pp->below) mode = pp->low;
+	else mode = pp->battery;
+
+	pr_info("s5divert: %s power, battery at %d%%, diverting to %s\n", supplied != 0 ? "AC" : "Battery", capacity, mode_names[mode]);
+	return mode;
+}
+
+/* Comma-separated list of ACPI device names and/or HIDs, "*" matches any device */
+static bool name_in_list(const char *list, const char *name, const char *hid)
+{
+	size_t len;
+
+	while (*list) {
+		len = strcspn(list, ",");
+		if (len == 1 && *list == '*') return true;
+		if (len && ((strlen(name) == len && !strncasecmp(list, name, len)) ||
+		            (strlen(hid) == len && !strncasecmp(list, hid, len)))) return true;
+		list += len;
+		if (*list) list++;
+	}
+	return false;
+}
+
+/*
+ * Hardware specific quirks, so that the common cases need no help from
+ * userspace at shutdown time. The configured mode is translated through
+ * map[], with 0 dropping the diversion altogether. If wake is set, the
+ * listed devices are armed regardless of /proc/acpi/wakeup, and with
+ * wake_only no other device is.
+ */
+struct s5divert_quirk {
+	char ident[64];
+	u8 map[S5DIVERT_MODES];
+	char wake[64];
+	bool wake_only;
+};
+
+static const struct s5divert_quirk quirk_thinkpad_p17 = {
+	// The lid plays nicely in any case, S3 does not.
+	.ident = "Lenovo ThinkPad P17 Gen2i",
+	.map = { 0, 1, 1, 3, 4, 1 },
+	.wake = "PNP0C0D",
+};
+
+static const struct s5divert_quirk quirk_starlite = {
+	// Wakes up fine from S3, but S4 is useless on this hardware.
+	.ident = "StarLabs StarLite",
+	.map = { 0, 0, 2, 3, 4, 2 },
+};
+
+static const struct s5divert_quirk quirk_hp_elite_x2 = {
+	// The EC loves to drain the battery in S4 and S3.
+	.ident = "HP Elite x2 G4",
+	.map = { 0, 0, 0, 3, 4, 0 },
+};
+
+static const struct s5divert_quirk quirk_mbp161 = {
+	// Behaves nicely in S5 already, and the lid triggers instantly in S4 and S3.
+	.ident = "Apple MacBook Pro 16,1",
+	.map = { 0, 0, 0, 3, 4, 0 },
+};
+
+static const struct s5divert_quirk quirk_mbp111 = {
+	// The lid triggers instantly unless it's closed, the power supply unless it's unplugged.
+	// Both are left to s5divert.shutdown, but the EC is always fine.
+	.ident = "Apple MacBook Pro 11,1",
+	.map = { 0, 1, 2, 3, 4, 5 },
+	.wake = "EC",
+};
+
+static const struct dmi_system_id quirks_dmi[] = {
+	{
+		.ident = "Lenovo ThinkPad P17 Gen2i",
+		.matches = { DMI_MATCH(DMI_SYS_VENDOR, "LENOVO"), DMI_MATCH(DMI_PRODUCT_NAME, "20YU") },
+		.driver_data = (void *)&quirk_thinkpad_p17,
+	},
+	{
+		.ident = "StarLabs StarLite",
+		.matches = { DMI_EXACT_MATCH(DMI_PRODUCT_NAME, "StarLite") },
+		.driver_data = (void *)&quirk_starlite,
+	},
+	{
+		.ident = "HP Elite x2 G4",
+		.matches = { DMI_MATCH(DMI_SYS_VENDOR, "HP"), DMI_EXACT_MATCH(DMI_PRODUCT_NAME, "HP Elite x2 G4") },
+		.driver_data = (void *)&quirk_hp_elite_x2,
+	},
+	{
+		.ident = "Apple MacBook Pro 16,1",
+		.matches = { DMI_MATCH(DMI_SYS_VENDOR, "Apple"), DMI_EXACT_MATCH(DMI_PRODUCT_NAME, "MacBookPro16,1") },
+		.driver_data = (void *)&quirk_mbp161,
+	},
+	{
+		.ident = "Apple MacBook Pro 11,1",
+		.matches = { DMI_MATCH(DMI_SYS_VENDOR, "Apple"), DMI_EXACT_MATCH(DMI_PRODUCT_NAME, "MacBookPro11,1") },
+		.driver_data = (void *)&quirk_mbp111,
+	},
+	{ }
+};
+
+/* Quirks added at runtime through sysfs; they take precedence over quirks_dmi[] */
+struct quirk_entry {
+	struct list_head list;
+	char vendor[64];
+	char product[64];
+	struct s5divert_quirk q;
+};
+
+static LIST_HEAD(quirks_runtime);
+static DEFINE_MUTEX(quirks_lock);
+static struct s5divert_quirk quirk_active;
+static const struct s5divert_quirk *quirk_active_src = NULL;	/* the entry quirk_active was copied from */
+static bool quirk_matched = false;
+
+/* Substring match like DMI_MATCH; '_' in pattern stands for a space as well */
+static bool dmi_field_matches(int field, const char *pattern)
+{
+	const char *info = dmi_get_system_info(field);
+	size_t i, len = strlen(pattern);
+
+	if (!len) return true;
+	if (!info) return false;
+	for (; strlen(info) >= len; info++) {
+		for (i = 0; i < len; i++) {
+			if (info[i] != pattern[i] && !(pattern[i] == '_' && info[i] == ' ')) break;
+		}
+		if (i == len) return true;
+	}
+	return false;
+}
+
+static void quirks_resolve(void)
+{
+	const struct dmi_system_id *id;
+	struct quirk_entry *e;
+	const struct s5divert_quirk *q = NULL;
+
+	lockdep_assert_held(&quirks_lock);
+	list_for_each_entry(e, &quirks_runtime, list) {
+		if (dmi_field_matches(DMI_SYS_VENDOR, e->vendor) && dmi_field_matches(DMI_PRODUCT_NAME, e->product)) {
+			q = &e->q;
+			break;
+		}
+	}
+	if (!q) {
+		id = dmi_first_match(quirks_dmi);
+		if (id) q = id->driver_data;
+	}
+
+	if (q) {
+		if (!quirk_matched || strcmp(quirk_active.ident, q->ident)) pr_info("s5divert: Applying quirks for %s\n", q->ident);
+		quirk_active = *q;
+		quirk_matched = true;
+	} else {
+		quirk_matched = false;
+	}
+	quirk_active_src = q;
+}
+
+static u8 quirk_map_mode(u8 mode)
+{
+	mutex_lock(&quirks_lock);
+	if (quirk_matched && mode < S5DIVERT_MODES) mode = quirk_active.map[mode];
+	mutex_unlock(&quirks_lock);
+	return mode;
+}
+
+static int quirk_parse_kv(const char *key, char *val, void *ctx)
+{
+	struct quirk_entry *e = ctx;
+	u8 from, to;
+	bool b;
+	int ret;
+
+	if (!strcmp(key, "vendor")) {
+		strscpy(e->vendor, val, sizeof(e->vendor));
+	} else if (!strcmp(key, "product")) {
+		strscpy(e->product, val, sizeof(e->product));
+		strscpy(e->q.ident, val, sizeof(e->q.ident));
+	} else if (!strcmp(key, "wake")) {
+		strscpy(e->q.wake, val, sizeof(e->q.wake));
+	} else if (!strcmp(key, "wake_only")) {
+		ret = kstrtobool(val, &b);
+		if (ret) return ret;
+		e->q.wake_only = b;
+	} else if (!strcmp(key, "disable")) {
+		ret = kstrtobool(val, &b);
+		if (ret) return ret;
+		if (b) memset(e->q.map, 0, sizeof(e->q.map));
+	} else if (!mode_parse(key, &from) && from > 0) {
+		// <configured mode>=<effective mode>, e.g. S3=S4
+		ret = mode_parse(val, &to);
+		if (ret) return ret;
+		e->q.map[from] = to;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int quirks_add(char *buf)
+{
+	struct quirk_entry *e, *tmp;
+	int i, ret;
+
+	if (sysfs_streq(buf, "clear")) {
+		mutex_lock(&quirks_lock);
+		list_for_each_entry_safe(e, tmp, &quirks_runtime, list) {
+			list_del(&e->list);
+			kfree(e);
+		}
+		quirks_resolve();
+		mutex_unlock(&quirks_lock);
+		return 0;
+	}
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if (!e) return -ENOMEM;
+	for (i = 0; i < S5DIVERT_MODES; i++) e->q.map[i] = i;
+
+	ret = kv_parse(buf, quirk_parse_kv, e);
+	if (!ret && !e->vendor[0] && !e->product[0]) ret = -EINVAL;
+	if (ret) {
+		kfree(e);
+		return ret;
+	}
+	if (!e->q.ident[0]) strscpy(e->q.ident, e->vendor, sizeof(e->q.ident));
+
+	mutex_lock(&quirks_lock);
+	list_add(&e->list, &quirks_runtime);
+	quirks_resolve();
+	mutex_unlock(&quirks_lock);
+	return 0;
+}
+
+static void quirks_free(void)
+{
+	struct quirk_entry *e, *tmp;
+
+	mutex_lock(&quirks_lock);
+	list_for_each_entry_safe(e, tmp, &quirks_runtime, list) {
+		list_del(&e->list);
+		kfree(e);
+	}
+	quirk_matched = false;
+	quirk_active_src = NULL;
+	mutex_unlock(&quirks_lock);
+}
+
+static int quirk_show(char *buf, int len, bool active, const char *vendor, const char *product, const struct s5divert_quirk *q)
+{
+	int i;
+
+	len += sysfs_emit_at(buf, len, "%c", active ? '*' : ' ');
+	if (vendor && *vendor) len += sysfs_emit_at(buf, len, " vendor=%s", vendor);
+	if (product && *product) len += sysfs_emit_at(buf, len, " product=%s", product);
+	for (i = 1; i < S5DIVERT_MODES; i++) len += sysfs_emit_at(buf, len, " %s=%s", mode_names[i], mode_names[q->map[i]]);
+	if (q->wake[0]) len += sysfs_emit_at(buf, len, " wake=%s wake_only=%d", q->wake, q->wake_only ? 1 : 0);
+	len += sysfs_emit_at(buf, len, "\n");
+	return len;
+}
+
+static int quirks_show(char *buf)
+{
+	const struct dmi_system_id *id;
+	const struct s5divert_quirk *q;
+	struct quirk_entry *e;
+	char vendor[80], product[80];
+	int i, len = 0;
+
+	mutex_lock(&quirks_lock);
+	list_for_each_entry(e, &quirks_runtime, list) {
+		len = quirk_show(buf, len, quirk_active_src == &e->q, e->vendor, e->product, &e->q);
+	}
+	for (id = quirks_dmi; id->matches[0].slot != DMI_NONE; id++) {
+		q = id->driver_data;
+		vendor[0] = product[0] = '\0';
+		for (i = 0; i < ARRAY_SIZE(id->matches); i++) {
+			if (id->matches[i].slot == DMI_SYS_VENDOR) strscpy(vendor, id->matches[i].substr, sizeof(vendor));
+			if (id->matches[i].slot == DMI_PRODUCT_NAME) strscpy(product, id->matches[i].substr, sizeof(product));
+		}
+		strreplace(vendor, ' ', '_');
+		strreplace(product, ' ', '_');
+		len = quirk_show(buf, len, quirk_active_src == q, vendor, product, q);
+	}
+	mutex_unlock(&quirks_lock);
+	return len;
+}
+
+/*
+ * Wake-capable devices are collected once at load time (and again whenever
+ * ACPI reconfigures its namespace or a device with an ACPI companion is
+ * hot-plugged), so the shutdown path only has to iterate this array instead
+ * of walking the whole ACPI namespace. Each entry holds a reference on its
+ * ACPI device, which is checked to still be attached to the handle before
+ * evaluating anything on it. Whether a device is actually enabled in
+ * /proc/acpi/wakeup is not cached but looked up at arming time, so changes
+ * there take effect immediately.
+ */
+struct wake_dev {
+	char name[5];
+	char hid[ACPI_ID_LEN];
+	acpi_handle handle;
+	struct acpi_device *adev;
+	acpi_handle gpe_device;
+	u32 gpe_number;
+	bool has_dsw;
+	bool is_lid;
+	bool armed;
+	int rc;
+	/* Time spent in _DSW/_PSW and in setting the GPE wake mask by the last arming pass */
+	s64 method_us;
+	s64 mask_us;
+	s64 duration_us;
+};
+
+struct wake_devs_build {
+	struct wake_dev *devs;
+	unsigned int count;
+	unsigned int size;
+};
+
+static struct wake_dev *wake_devs = NULL;
+static unsigned int wake_devs_count = 0;
+static DEFINE_MUTEX(wake_devs_lock);
+
+/* Phases of a diversion, as seen by the tracepoints and the timeline */
+enum { PHASE_FS_SYNC, PHASE_TTS, PHASE_WAKE_ARM, PHASE_SLEEP_PREP, PHASE_SLEEP, PHASE_PM_SUSPEND, PHASE_REBOOT, PHASE_KEXEC, PHASES };
+static const char * const phase_names[PHASES] = { "fs_sync", "_TTS", "wake_arm", "sleep_prep", "sleep", "pm_suspend", "reboot", "kexec" };
+#define PHASE_NONE 0xff
+
+/*
+ * Modes 1 and 2 never return, so the timeline of a diversion is stored in
+ * an EFI variable right before the point of no return, and decoded into
+ * last_shutdown by the next load of the module.
+ */
+#define TIMELINE_MAGIC 0x56443553	/* "S5DV" */
+#define TIMELINE_VERSION 2
+#define TIMELINE_DEVS 16
+#define TIMELINE_ATTEMPTS (1 + FALLBACK_LEN)
+
+struct timeline_dev {
+	char name[5];
+	u8 flags;
+	s16 rc;
+	u32 us;
+} __packed;
+#define TIMELINE_DEV_ARMED	BIT(0)
+#define TIMELINE_DEV_DSW	BIT(1)
+
+/* The configured mode and each fallback after it; the last one is the one taken */
+struct timeline_attempt {
+	u8 mode;
+	u8 done;		/* returned, i.e. failed or skipped */
+	s16 rc;
+	u32 start_us;
+	u32 us;
+} __packed;
+
+struct s5divert_timeline {
+	u32 magic;
+	u8 version;
+	u8 mode;
+	u8 failed;		/* phase the diversion failed in, or PHASE_NONE */
+	u8 ndevs;
+	u8 nattempts;
+	s64 time;		/* wall clock seconds at the start */
+	u16 entered;		/* bitmap of phases */
+	u16 exited;
+	u32 enter_us[PHASES];	/* since the start */
+	u32 exit_us[PHASES];
+	s32 rc[PHASES];
+	struct timeline_dev devs[TIMELINE_DEVS];
+	struct timeline_attempt attempts[TIMELINE_ATTEMPTS];
+} __packed;
+
+static struct s5divert_timeline timeline;
+static bool timeline_active = false;
+static ktime_t timeline_start;
+
+/*
+ * Steps of a diversion that may hang (syncing, preparing a sleep state)
+ * run on workers when there is a deadline. Once the diversion stops waiting
+ * for one, it is abandoned: whatever it still publishes, to the timeline or
+ * otherwise, is dropped, as the diversion has moved on. The flags are
+ * set and checked under divert_job_lock.
+ */
+static DEFINE_SPINLOCK(divert_job_lock);
+static struct work_struct sync_work, prep_work;
+static bool sync_abandoned = false;
+static bool prep_abandoned = false;
+
+/* Whether current is an abandoned worker; called with divert_job_lock held */
+static bool divert_job_abandoned_locked(void)
+{
+	struct work_struct *w = current_work();
+
+	return (w == &sync_work && sync_abandoned) || (w == &prep_work && prep_abandoned);
+}
+
+static bool divert_job_abandoned(void)
+{
+	unsigned long flags;
+	bool ret;
+
+	spin_lock_irqsave(&divert_job_lock, flags);
+	ret = divert_job_abandoned_locked();
+	spin_unlock_irqrestore(&divert_job_lock, flags);
+	return ret;
+}
+
+static void divert_job_abandon(bool *abandoned)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&divert_job_lock, flags);
+	*abandoned = true;
+	spin_unlock_irqrestore(&divert_job_lock, flags);
+}
+static struct s5divert_timeline last_shutdown;
+static bool last_shutdown_valid = false;
+
+#if IS_ENABLED(CONFIG_EFI)
+static efi_guid_t s5divert_efi_guid = EFI_GUID(0x5a0e1bd4, 0x2c3f, 0x4b8e, 0x9d, 0x61, 0x7f, 0x2a, 0xc4, 0x13, 0x58, 0xe9);
+
+#define EFIVAR_ATTR (EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+/*
+ * Go through the efivars layer rather than calling into the runtime services
+ * directly, so that accesses are serialized against efivarfs, pstore and
+ * the variable size checks of the platform.
+ */
+static int efivar_lock_err(int ret)
+{
+	// No efivars registered, e.g. with efi=noruntime
+	return ret == -ENODEV ? -EOPNOTSUPP : ret;
+}
+
+static int efivar_store(efi_char16_t *name, void *data, unsigned long size)
+{
+	int ret;
+
+	if (!efi_rt_services_supported(EFI_RT_SUPPORTED_SET_VARIABLE)) return -EOPNOTSUPP;
+	if ((ret = efivar_lock())) return efivar_lock_err(ret);
+	// A size of 0 deletes the variable
+	ret = efi_status_to_err(efivar_set_variable_locked(name, &s5divert_efi_guid, size ? EFIVAR_ATTR : 0, size, data, false));
+	efivar_unlock();
+	return ret;
+}
+
+/* Same as efivar_store(), for callers that must not sleep */
+static int efivar_store_nonblocking(efi_char16_t *name, void *data, unsigned long size)
+{
+	int ret;
+
+	if (!efi_rt_services_supported(EFI_RT_SUPPORTED_SET_VARIABLE)) return -EOPNOTSUPP;
+	if ((ret = efivar_trylock())) return efivar_lock_err(ret);
+	ret = efi_status_to_err(efivar_set_variable_locked(name, &s5divert_efi_guid, size ? EFIVAR_ATTR : 0, size, data, true));
+	efivar_unlock();
+	return ret;
+}
+
+static int efivar_load(efi_char16_t *name, void *data, unsigned long size)
+{
+	unsigned long len = size;
+	u32 attr;
+	int ret;
+
+	if (!efi_rt_services_supported(EFI_RT_SUPPORTED_GET_VARIABLE)) return -EOPNOTSUPP;
+	if ((ret = efivar_lock())) return efivar_lock_err(ret);
+	ret = efi_status_to_err(efivar_get_variable(name, &s5divert_efi_guid, &attr, &len, data));
+	efivar_unlock();
+	if (ret) return ret;
+	return len == size ? 0 : -EINVAL;
+}
+#else
+static int efivar_store(efi_char16_t *name, void *data, unsigned long size)
+{
+	if (!efi_rt_services_supported(EFI_RT_SUPPORTED_SET_VARIABLE)) return -EOPNOTSUPP;
+	// A size of 0 deletes the variable
+	return efi_status_to_err(efi.set_variable(name, &s5divert_efi_guid, size ? EFIVAR_ATTR : 0, size, data));
+}
+
+/* Same as efivar_store(), for callers that must not sleep */
+static int efivar_store_nonblocking(efi_char16_t *name, void *data, unsigned long size)
+{
+	if (!efi_rt_services_supported(EFI_RT_SUPPORTED_SET_VARIABLE) || !efi.set_variable_nonblocking) return -EOPNOTSUPP;
+	return efi_status_to_err(efi.set_variable_nonblocking(name, &s5divert_efi_guid, size ? EFIVAR_ATTR : 0, size, data));
+}
+
+static int efivar_load(efi_char16_t *name, void *data, unsigned long size)
+{
+	unsigned long len = size;
+	u32 attr;
+	int ret;
+
+	if (!efi_rt_services_supported(EFI_RT_SUPPORTED_GET_VARIABLE)) return -EOPNOTSUPP;
+	ret = efi_status_to_err(efi.get_variable(name, &s5divert_efi_guid, &attr, &len, data));
+	if (ret) return ret;
+	return len == size ? 0 : -EINVAL;
+}
+#endif
+#else
+static int efivar_store(efi_char16_t *name, void *data, unsigned long size) { return -EOPNOTSUPP; }
+static int efivar_store_nonblocking(efi_char16_t *name, void *data, unsigned long size) { return -EOPNOTSUPP; }
+static int efivar_load(efi_char16_t *name, void *data, unsigned long size) { return -EOPNOTSUPP; }
+#endif
+
+static efi_char16_t timeline_efi_name[] = L"S5DivertTimeline";
+
+/*
+ * enabled=5 enters S3 with an RTC alarm set s3s4_hours ahead. Without a
+ * waking vector, the alarm leads to a fresh boot. The deadline is kept in
+ * an EFI variable, so that the module loading during that boot can tell
+ * and powers off again, diverted to S4 this time. That takes proof that
+ * the alarm woke the system, not the user pressing the power button late.
+ */
+#define S3S4_WAKE_WINDOW (15 * 60)	/* s from the alarm to the module being loaded */
+
+static efi_char16_t s3s4_efi_name[] = L"S5DivertS3S4Deadline";
+static bool s3s4_expired = false;
+
+static void s3s4_poweroff_worker(struct work_struct *work)
+{
+	orderly_poweroff(true);
+}
+
+static DECLARE_WORK(s3s4_poweroff_work, s3s4_poweroff_worker);
+
+#if IS_ENABLED(CONFIG_RTC_CLASS)
+static int s3s4_rtc_now(struct rtc_device *rtc, time64_t *now)
+{
+	struct rtc_time tm;
+	int ret = rtc_read_time(rtc, &tm);
+
+	if (!ret) *now = rtc_tm_to_time64(&tm);
+	return ret;
+}
+
+static int s3s4_alarm_arm(unsigned int hours)
+{
+	struct rtc_wkalrm alarm = { .enabled = 1 };
+	struct rtc_device *rtc;
+	time64_t deadline;
+	int ret;
+
+	if (!hours) return -EINVAL;
+	rtc = rtc_class_open("rtc0");
+	if (!rtc) return -ENODEV;
+
+	ret = s3s4_rtc_now(rtc, &deadline);
+	if (ret) goto out;
+	deadline += (time64_t)hours * 3600;
+	// Without the deadline, the next boot would not know to power off again
+	ret = efivar_store(s3s4_efi_name, &deadline, sizeof(deadline));
+	if (ret) goto out;
+	rtc_time64_to_tm(deadline, &alarm.time);
+	ret = rtc_set_alarm(rtc, &alarm);
+	if (ret) efivar_store(s3s4_efi_name, NULL, 0);
+	else pr_info("s5divert: RTC alarm set to %ptRs\n", &alarm.time);
+out:
+	rtc_class_close(rtc);
+	return ret;
+}
+
+/*
+ * Firmware leaves RTC_STS latched in PM1 when the alarm wakes the system.
+ * rtc-cmos clears it, and RTC_AF along with it, once it has been loaded,
+ * so then the RTC must still hold the alarm at the deadline, WAK_STS must
+ * be set and no other wake event may be latched. Needs wake_reason_capture().
+ */
+static bool s3s4_alarm_fired(struct rtc_device *rtc, time64_t deadline)
+{
+	struct rtc_wkalrm alarm;
+
+	if (wake_reason_latched("RTC")) return true;
+	if (rtc_read_alarm(rtc, &alarm) || rtc_tm_to_time64(&alarm.time) != deadline) return false;
+	return alarm.pending || wake_reason_cleared("RTC");
+}
+
+static void s3s4_check(void)
+{
+	struct rtc_device *rtc;
+	time64_t deadline, now = 0;
+
+	if (efivar_load(s3s4_efi_name, &deadline, sizeof(deadline))) return;
+	efivar_store(s3s4_efi_name, NULL, 0);
+	rtc = rtc_class_open("rtc0");
+	if (!rtc) return;
+	if (!s3s4_rtc_now(rtc, &now)) {
+		// Woken up before the alarm: it must not wake the system from S5 later on
+		if (now < deadline) rtc_alarm_irq_enable(rtc, 0);
+		else if (now - deadline < S3S4_WAKE_WINDOW) s3s4_expired = s3s4_alarm_fired(rtc, deadline);
+	}
+	rtc_class_close(rtc);
+	if (!s3s4_expired) {
+		if (now >= deadline) pr_info("s5divert: Past the S3S4 deadline, but not woken up by its alarm\n");
+		return;
+	}
+
+	pr_warn("s5divert: Woken up by the S3S4 alarm, powering off to S4\n");
+	// Not from module init, which would hold up whoever loads the module
+	schedule_work(&s3s4_poweroff_work);
+}
+#else
+static int s3s4_alarm_arm(unsigned int hours) { return -EOPNOTSUPP; }
+static void s3s4_check(void) { }
+#endif
+
+static u32 timeline_us(void)
+{
+	return min_t(s64, ktime_us_delta(ktime_get(), timeline_start), U32_MAX);
+}
+
+static void timeline_begin(u8 mode)
+{
+	memset(&timeline, 0, sizeof(timeline));
+	timeline.magic = TIMELINE_MAGIC;
+	timeline.version = TIMELINE_VERSION;
+	timeline.mode = mode;
+	timeline.failed = PHASE_NONE;
+	timeline.time = ktime_get_real_seconds();
+	timeline_start = ktime_get();
+	timeline_active = true;
+}
+
+static void timeline_store(void)
+{
+	int ret;
+
+	if (!efi_records_enabled()) return;
+	ret = efivar_store(timeline_efi_name, &timeline, sizeof(timeline));
+	if (ret && ret != -EOPNOTSUPP) {
+		pr_warn("s5divert: Unable to store the shutdown timeline: %pe\n", ERR_PTR(ret));
+		status_error("last_shutdown", ret);
+	}
+}
+
+static void timeline_add_devs(void)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&divert_job_lock, flags);
+	if (!timeline_active || divert_job_abandoned_locked()) goto out;
+	for (i = 0; i < wake_devs_count && timeline.ndevs < TIMELINE_DEVS; i++) {
+		const struct wake_dev *wd = &wake_devs[i];
+		struct timeline_dev *td;
+
+		if (!wd->armed && !wd->rc) continue;
+		td = &timeline.devs[timeline.ndevs++];
+		memcpy(td->name, wd->name, sizeof(td->name));
+		td->flags = (wd->armed ? TIMELINE_DEV_ARMED : 0) | (wd->has_dsw ? TIMELINE_DEV_DSW : 0);
+		td->rc = wd->rc;
+		td->us = min_t(s64, wd->duration_us, U32_MAX);
+	}
+out:
+	spin_unlock_irqrestore(&divert_job_lock, flags);
+}
+
+static void timeline_attempt_begin(u8 mode)
+{
+	struct timeline_attempt *ta;
+
+	if (!timeline_active || timeline.nattempts == TIMELINE_ATTEMPTS) return;
+	ta = &timeline.attempts[timeline.nattempts++];
+	ta->mode = mode;
+	ta->start_us = timeline_us();
+}
+
+static void timeline_attempt_end(int rc)
+{
+	struct timeline_attempt *ta;
+
+	if (!timeline_active || !timeline.nattempts) return;
+	ta = &timeline.attempts[timeline.nattempts - 1];
+	ta->done = 1;
+	ta->rc = rc;
+	ta->us = timeline_us() - ta->start_us;
+}
+
+static void phase_enter(u8 phase, int arg)
+{
+	unsigned long flags;
+
+	trace_s5divert_phase_enter(phase_names[phase], arg);
+	spin_lock_irqsave(&divert_job_lock, flags);
+	if (timeline_active && !divert_job_abandoned_locked()) {
+		timeline.entered |= BIT(phase);
+		timeline.enter_us[phase] = timeline_us();
+	}
+	spin_unlock_irqrestore(&divert_job_lock, flags);
+}
+
+static void phase_exit(u8 phase, int rc)
+{
+	unsigned long flags;
+
+	trace_s5divert_phase_exit(phase_names[phase], rc);
+	spin_lock_irqsave(&divert_job_lock, flags);
+	if (timeline_active && !divert_job_abandoned_locked()) {
+		timeline.exited |= BIT(phase);
+		timeline.exit_us[phase] = timeline_us();
+		timeline.rc[phase] = rc;
+	}
+	spin_unlock_irqrestore(&divert_job_lock, flags);
+}
+
+/*
+ * The last phases before the point of no return (sleep, reboot)
+ * store the timeline as if they had been entered already, ahead of the work
+ * leading up to them, so that writing the variable neither counts towards
+ * them nor delays them.
+ */
+static void phase_store_final(u8 phase)
+{
+	if (!timeline_active) return;
+	timeline.entered |= BIT(phase);
+	timeline.enter_us[phase] = timeline_us();
+	timeline_store();
+}
+
+/* Records that the diversion did not get past this phase */
+static void phase_failed(u8 phase)
+{
+	unsigned long flags;
+	bool store = false;
+
+	spin_lock_irqsave(&divert_job_lock, flags);
+	if (timeline_active && timeline.failed == PHASE_NONE && !divert_job_abandoned_locked()) {
+		timeline.failed = phase;
+		store = true;
+	}
+	spin_unlock_irqrestore(&divert_job_lock, flags);
+	if (store) timeline_store();
+}
+
+static void last_shutdown_load(void)
+{
+	int i;
+
+	if (efivar_load(timeline_efi_name, &last_shutdown, sizeof(last_shutdown))) return;
+	// Each timeline is reported by the boot right after it only
+	efivar_store(timeline_efi_name, NULL, 0);
+	last_shutdown_valid = last_shutdown.magic == TIMELINE_MAGIC && last_shutdown.version == TIMELINE_VERSION &&
+		last_shutdown.mode < S5DIVERT_MODES && last_shutdown.ndevs <= TIMELINE_DEVS &&
+		last_shutdown.nattempts <= TIMELINE_ATTEMPTS &&
+		(last_shutdown.failed < PHASES || last_shutdown.failed == PHASE_NONE);
+	for (i = 0; last_shutdown_valid && i < last_shutdown.nattempts; i++)
+		last_shutdown_valid = last_shutdown.attempts[i].mode < S5DIVERT_MODES;
+}
+
+static int last_shutdown_show(char *buf)
+{
+	const struct s5divert_timeline *tl = &last_shutdown;
+	int i, len = 0;
+
+	if (!last_shutdown_valid) return sysfs_emit(buf, "none\n");
+
+	len += sysfs_emit_at(buf, len, "time=%lld mode=%s result=", tl->time, mode_names[tl->mode]);
+	if (tl->failed != PHASE_NONE) len += sysfs_emit_at(buf, len, "failed:%s\n", phase_names[tl->failed]);
+	else len += sysfs_emit_at(buf, len, "ok\n");
+
+	for (i = 0; i < PHASES; i++) {
+		if (!(tl->entered & BIT(i))) continue;
+		len += sysfs_emit_at(buf, len, "phase=%s start_us=%u", phase_names[i], tl->enter_us[i]);
+		if (tl->exited & BIT(i)) len += sysfs_emit_at(buf, len, " duration_us=%u rc=%d\n", tl->exit_us[i] - tl->enter_us[i], tl->rc[i]);
+		else len += sysfs_emit_at(buf, len, " duration_us=- rc=-\n");
+	}
+	for (i = 0; i < tl->ndevs; i++) {
+		const struct timeline_dev *td = &tl->devs[i];
+		len += sysfs_emit_at(buf, len, "wake=%.4s method=%s armed=%d duration_us=%u rc=%d\n", td->name,
+			td->flags & TIMELINE_DEV_DSW ? "_DSW" : "_PSW", td->flags & TIMELINE_DEV_ARMED ? 1 : 0, td->us, td->rc);
+	}
+	for (i = 0; i < tl->nattempts; i++) {
+		const struct timeline_attempt *ta = &tl->attempts[i];
+		len += sysfs_emit_at(buf, len, "attempt=%s start_us=%u", ta->mode ? mode_names[ta->mode] : "S5", ta->start_us);
+		if (ta->done) len += sysfs_emit_at(buf, len, " duration_us=%u rc=%d\n", ta->us, ta->rc);
+		else len += sysfs_emit_at(buf, len, " duration_us=- rc=-\n");
+	}
+	return len;
+}
+
+static acpi_status wake_devs_build_cb(acpi_handle handle, u32 lvl, void *context, void **rv)
+{
+	struct wake_devs_build *b = context;
+	struct acpi_device *adev = acpi_fetch_acpi_dev(handle);
+	struct wake_dev *wd;
+
+	if (!adev || !adev->wakeup.flags.valid) return AE_OK;
+
+	if (b->count == b->size) {
+		unsigned int size = b->size ? b->size * 2 : 16;
+		struct wake_dev *devs = krealloc_array(b->devs, size, sizeof(*devs), GFP_KERNEL);
+		if (!devs) return AE_NO_MEMORY;
+		b->devs = devs;
+		b->size = size;
+	}
+
+	wd = &b->devs[b->count++];
+	strscpy(wd->name, acpi_device_bid(adev), sizeof(wd->name));
+	strscpy(wd->hid, acpi_device_hid(adev), sizeof(wd->hid));
+	wd->handle = handle;
+	wd->adev = acpi_dev_get(adev);
+	wd->gpe_device = adev->wakeup.gpe_device;
+	wd->gpe_number = adev->wakeup.gpe_number;
+	wd->has_dsw = acpi_has_method(handle, "_DSW");
+	wd->is_lid = is_lid_device(adev);
+	wd->armed = false;
+	wd->rc = 0;
+	return AE_OK;
+}
+
+static void wake_devs_put(struct wake_dev *devs, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) acpi_dev_put(devs[i].adev);
+	kfree(devs);
+}
+
+static int wake_devs_refresh(void)
+{
+	struct wake_devs_build b = { };
+	struct wake_dev *old;
+	unsigned int old_count;
+	acpi_status st;
+
+	// Keeps devices from being detached while their references are taken
+	acpi_scan_lock_acquire();
+	st = acpi_walk_namespace(ACPI_TYPE_DEVICE, ACPI_ROOT_OBJECT, ACPI_UINT32_MAX, wake_devs_build_cb, NULL, &b, NULL);
+	acpi_scan_lock_release();
+	if (ACPI_FAILURE(st)) {
+		wake_devs_put(b.devs, b.count);
+		pr_err("s5divert: Unable to collect ACPI wakeup devices: %s\n", acpi_format_exception(st));
+		status_error("wake_devs", -ENOMEM);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&wake_devs_lock);
+	old = wake_devs;
+	old_count = wake_devs_count;
+	wake_devs = b.devs;
+	wake_devs_count = b.count;
+	mutex_unlock(&wake_devs_lock);
+	wake_devs_put(old, old_count);
+
+	pr_debug("s5divert: %u ACPI wakeup devices cached\n", b.count);
+	status_changed();
+	return 0;
+}
+
+static void wake_devs_free(void)
+{
+	mutex_lock(&wake_devs_lock);
+	wake_devs_put(wake_devs, wake_devs_count);
+	wake_devs = NULL;
+	wake_devs_count = 0;
+	mutex_unlock(&wake_devs_lock);
+}
+
+static void wake_devs_refresh_worker(struct work_struct *work)
+{
+	wake_devs_refresh();
+}
+
+static DECLARE_WORK(wake_devs_refresh_work, wake_devs_refresh_worker);
+
+static int wake_devs_reconfig_cb(struct notifier_block *nb, unsigned long action, void *arg)
+{
+	// Devices come and go in bursts, so let the worker pick them all up at once.
+	if (action == ACPI_RECONFIG_DEVICE_ADD || action == ACPI_RECONFIG_DEVICE_REMOVE)
+		schedule_work(&wake_devs_refresh_work);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block wake_devs_reconfig_nb = {
+	.notifier_call = wake_devs_reconfig_cb,
+};
+
+/*
+ * PCI hotplug (Thunderbolt docks, ExpressCard, ...) and platform devices
+ * enumerated late don't reconfigure the ACPI namespace, but may attach or
+ * detach the ACPI devices of wake-capable companions.
+ */
+static int wake_devs_bus_cb(struct notifier_block *nb, unsigned long action, void *data)
+{
+	struct acpi_device *adev = ACPI_COMPANION((struct device *)data);
+
+	if ((action == BUS_NOTIFY_ADD_DEVICE || action == BUS_NOTIFY_DEL_DEVICE) && adev && adev->wakeup.flags.valid)
+		schedule_work(&wake_devs_refresh_work);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block wake_devs_pci_nb = {
+	.notifier_call = wake_devs_bus_cb,
+};
+
+static struct notifier_block wake_devs_platform_nb = {
+	.notifier_call = wake_devs_bus_cb,
+};
+
+/*
+ * With lid_wait_ms set, diversions to S4/S3 and stroff first wait for the
+ * lid to close, blinking LEDs bound to the "s5divert-lid" trigger, e.g.
+ * /sys/class/leds/input0::capslock. An open lid would wake the system up
+ * right away, so the lid is armed as a wakeup device only if it closed.
+ */
+#define LID_LED_BLINK_MS 500
+
+static struct led_trigger *lid_led_trigger = NULL;
+static int lid_state = -1;	/* 1 if the lid closed in time, 0 if not, -1 if not waited for */
+
+#if IS_REACHABLE(CONFIG_INPUT)
+static void lid_led_blink(void)
+{
+	unsigned long delay = LID_LED_BLINK_MS;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+	led_trigger_blink(lid_led_trigger, &delay, &delay);
+#else
+	led_trigger_blink(lid_led_trigger, delay, delay);
+#endif
+}
+
+/*
+ * The lid is an input switch, whichever driver reports it (ACPI button,
+ * EC, platform drivers), so listen to SW_LID for as long as the wait lasts.
+ */
+static DECLARE_COMPLETION(lid_closed);
+static unsigned int lid_switches = 0;
+/* The handler and its completion serve one wait at a time, e.g. stroff racing a poweroff */
+static DEFINE_MUTEX(lid_lock);
+
+static void lid_input_event(struct input_handle *handle, unsigned int type, unsigned int code, int value)
+{
+	if (type == EV_SW && code == SW_LID && value) complete(&lid_closed);
+}
+
+static int lid_input_connect(struct input_handler *handler, struct input_dev *dev, const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int ret;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle) return -ENOMEM;
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "s5divert-lid";
+
+	if ((ret = input_register_handle(handle))) goto err_free;
+	if ((ret = input_open_device(handle))) goto err_unregister;
+	lid_switches++;
+	// Opened before looking, so that closing it in between isn't missed
+	if (test_bit(SW_LID, dev->sw)) complete(&lid_closed);
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return ret;
+}
+
+static void lid_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id lid_input_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_SWBIT,
+		.evbit = { BIT_MASK(EV_SW) },
+		.swbit = { [BIT_WORD(SW_LID)] = BIT_MASK(SW_LID) },
+	},
+	{ },
+};
+
+static struct input_handler lid_input_handler = {
+	.event = lid_input_event,
+	.connect = lid_input_connect,
+	.disconnect = lid_input_disconnect,
+	.name = "s5divert-lid",
+	.id_table = lid_input_ids,
+};
+
+static void lid_wait(const struct s5divert_config *cfg)
+{
+	bool closed;
+
+	mutex_lock(&lid_lock);
+	// Whatever an earlier wait found out is stale by now
+	lid_state = -1;
+	if (!cfg->lid_wait_ms) goto out;
+	reinit_completion(&lid_closed);
+	lid_switches = 0;
+	// Connects to all lid switches right away
+	if (input_register_handler(&lid_input_handler)) {
+		pr_warn("s5divert: Unable to listen to the lid\n");
+		goto out;
+	}
+	if (!lid_switches) {
+		input_unregister_handler(&lid_input_handler);
+		goto out;	// No lid at all
+	}
+
+	closed = completion_done(&lid_closed);
+	if (!closed) {
+		pr_info("s5divert: Waiting up to %u ms for the lid to close\n", cfg->lid_wait_ms);
+		lid_led_blink();
+		closed = wait_for_completion_timeout(&lid_closed, msecs_to_jiffies(cfg->lid_wait_ms));
+		led_trigger_event(lid_led_trigger, LED_OFF);
+	}
+	input_unregister_handler(&lid_input_handler);
+
+	lid_state = closed;
+	pr_info("s5divert: Lid %s, wakeup from lid %s\n", closed ? "closed" : "still open", closed ? "enabled" : "disabled");
+out:
+	mutex_unlock(&lid_lock);
+}
+#else
+static void lid_wait(const struct s5divert_config *cfg) { lid_state = -1; }
+#endif
+
+/* stroff suspends the regular way, which goes by /proc/acpi/wakeup, so that's where the lid goes */
+static void lid_wake_apply(void)
+{
+	unsigned int i;
+
+	if (lid_state < 0) return;
+	mutex_lock(&wake_devs_lock);
+	for (i = 0; i < wake_devs_count; i++) {
+		if (!wake_devs[i].is_lid) continue;
+		device_set_wakeup_enable(&wake_devs[i].adev->dev, lid_state);
+	}
+	mutex_unlock(&wake_devs_lock);
+}
+
+/* Snapshot of the wakeup policy while arming, protected by wake_devs_lock */
+static struct s5divert_quirk wake_quirk;
+static const struct s5divert_config *wake_cfg;
+static bool wake_dry_run = false;
+
+/*
+ * wake_allow beats wake_deny beats quirks beats /proc/acpi/wakeup, so
+ * wake_deny=* wake_allow=EC arms nothing but the EC. Waiting for the lid
+ * beats all of them.
+ */
+static bool wake_dev_wanted(const struct wake_dev *wd, struct acpi_device *adev)
+{
+	if (wd->is_lid && lid_state >= 0) return lid_state;
+	if (name_in_list(wake_cfg->wake_allow, wd->name, wd->hid)) return true;
+	if (name_in_list(wake_cfg->wake_deny, wd->name, wd->hid)) return false;
+	if (wake_quirk.wake[0]) {
+		if (name_in_list(wake_quirk.wake, wd->name, wd->hid)) return true;
+		if (wake_quirk.wake_only) return false;
+	}
+	return device_may_wakeup(&adev->dev);
+}
+
+static void enable_wake_gpe(struct wake_dev *wd)
+{
+	struct acpi_device *adev = wd->adev;
+	ktime_t start = ktime_get(), t;
+	wd->armed = false;
+	wd->rc = 0;
+	wd->method_us = wd->mask_us = wd->duration_us = 0;
+	// Detached by a hot-unplug the refresh has not caught up with yet; the scan lock is held
+	if (acpi_fetch_acpi_dev(wd->handle) != adev) return;
+	// Disarming after a dry run would take away a wakeup the kernel relies on, e.g. for runtime PM
+	if (wake_dry_run && (READ_ONCE(adev->wakeup.enable_count) || READ_ONCE(adev->wakeup.prepare_count))) return;
+
+	if (wake_dev_wanted(wd, adev)) {
+		wd->rc = acpi_call_dsw_or_psw(wd->handle, wd->has_dsw, 1, ACPI_STATE_S4, ACPI_STATE_D3_HOT, wake_cfg->dsw_delay_ms);
+		t = ktime_get();
+		wd->method_us = ktime_us_delta(t, start);
+		if (ACPI_FAILURE(acpi_set_gpe_wake_mask(wd->gpe_device, wd->gpe_number, ACPI_GPE_ENABLE))) wd->rc = -EIO;
+		wd->mask_us = ktime_us_delta(ktime_get(), t);
+		wd->armed = true;
+		if (wd->is_lid) {
+			pr_debug("s5divert: Wakeup from lid enabled\n");
+			WRITE_ONCE(lid_found, true);
+		}
+	} else if (wd->is_lid) {
+		pr_debug("s5divert: Wakeup from lid not enabled\n");
+		WRITE_ONCE(lid_found, true);
+	}
+	wd->duration_us = ktime_us_delta(ktime_get(), start);
+	trace_s5divert_wake_dev(wd->name, wd->hid, wd->gpe_number, wd->has_dsw, wd->armed, wd->rc, wd->duration_us);
+}
+
+/*
+ * Devices are independent of each other, so slow _DSW/_PSW methods (EC
+ * transactions, PCIe bridges, ...) may run side by side. The domain is
+ * private so that joining doesn't wait for unrelated async work.
+ */
+static ASYNC_DOMAIN_EXCLUSIVE(wake_async_domain);
+
+static void enable_wake_gpe_async(void *data, async_cookie_t cookie)
+{
+	enable_wake_gpe(data);
+}
+
+/* Whether a device armed by the last pass uses the same GPE as wd */
+static bool wake_gpe_armed(const struct wake_dev *wd)
+{
+	unsigned int i;
+
+	for (i = 0; i < wake_devs_count; i++) {
+		const struct wake_dev *o = &wake_devs[i];
+		if (o->armed && o->gpe_device == wd->gpe_device && o->gpe_number == wd->gpe_number) return true;
+	}
+	return false;
+}
+
+/*
+ * Don't leave a wake mask behind that someone else has set before. GPEs are
+ * often shared, e.g. by all devices behind one PCIe root port, so this only
+ * runs once all devices have been armed and skips GPEs any of them uses.
+ */
+static void wake_gpes_unmask_unwanted(void)
+{
+	unsigned int i;
+	ktime_t t;
+
+	for (i = 0; i < wake_devs_count; i++) {
+		struct wake_dev *wd = &wake_devs[i];
+		s64 us;
+
+		if (wd->armed || wake_gpe_armed(wd)) continue;
+		t = ktime_get();
+		acpi_set_gpe_wake_mask(wd->gpe_device, wd->gpe_number, ACPI_GPE_DISABLE);
+		us = ktime_us_delta(ktime_get(), t);
+		wd->mask_us += us;
+		wd->duration_us += us;
+	}
+}
+
+/* Arms the wakeup devices as configured, with wake_devs_lock held */
+static void wake_devs_arm(const struct s5divert_config *cfg)
+{
+	bool parallel = cfg->wake_parallel;
+	unsigned int i, failed = 0;
+
+	lockdep_assert_held(&wake_devs_lock);
+	lid_found = false;
+	phase_enter(PHASE_WAKE_ARM, wake_devs_count);
+	mutex_lock(&quirks_lock);
+	if (quirk_matched) wake_quirk = quirk_active;
+	else memset(&wake_quirk, 0, sizeof(wake_quirk));
+	mutex_unlock(&quirks_lock);
+	wake_cfg = cfg;
+	// No device may be detached while its methods are evaluated
+	acpi_scan_lock_acquire();
+	for (i = 0; i < wake_devs_count; i++) {
+		if (parallel) async_schedule_domain(enable_wake_gpe_async, &wake_devs[i], &wake_async_domain);
+		else enable_wake_gpe(&wake_devs[i]);
+	}
+	if (parallel) async_synchronize_full_domain(&wake_async_domain);
+	// A dry run must not take away wake masks set by others, as it has nothing to restore them from
+	if (!wake_dry_run) wake_gpes_unmask_unwanted();
+	acpi_scan_lock_release();
+	for (i = 0; i < wake_devs_count; i++) {
+		if (!wake_devs[i].rc) continue;
+		pr_warn("s5divert: Arming wakeup device %s failed: %pe\n", wake_devs[i].name, ERR_PTR(wake_devs[i].rc));
+		failed++;
+	}
+	if (timeline_active) timeline_add_devs();
+	phase_exit(PHASE_WAKE_ARM, failed);
+	wake_cfg = NULL;
+	if(!lid_found) pr_debug("s5divert: No lid wakeup source found\n");
+}
+
+static void acpi_enable_wakeup_devices(const struct s5divert_config *cfg)
+{
+	mutex_lock(&wake_devs_lock);
+	wake_devs_arm(cfg);
+	mutex_unlock(&wake_devs_lock);
+}
+
+/*
+ * Arms all wakeup devices just like a diversion would, then disarms them
+ * again right away without entering any sleep state. This fills in the
+ * timings shown by wakeup_devices. Devices the kernel has enabled to wake
+ * up at runtime are left alone, and so are the wake masks of GPEs no
+ * device is armed for.
+ */
+static void wake_devs_dry_run(void)
+{
+	struct s5divert_config cfg;
+	unsigned int i;
+
+	config_get(&cfg);
+	pr_info("s5divert: Arming wakeup devices for a dry run\n");
+	mutex_lock(&wake_devs_lock);
+	wake_dry_run = true;
+	wake_devs_arm(&cfg);
+	wake_dry_run = false;
+	acpi_scan_lock_acquire();
+	for (i = 0; i < wake_devs_count; i++) {
+		struct wake_dev *wd = &wake_devs[i];
+		if (!wd->armed) continue;
+		acpi_set_gpe_wake_mask(wd->gpe_device, wd->gpe_number, ACPI_GPE_DISABLE);
+		if (acpi_fetch_acpi_dev(wd->handle) == wd->adev)
+			acpi_call_dsw_or_psw(wd->handle, wd->has_dsw, 0, ACPI_STATE_S0, ACPI_STATE_D0, 0);
+		wd->armed = false;
+	}
+	acpi_scan_lock_release();
+	mutex_unlock(&wake_devs_lock);
+}
+
+/* /proc/s5divert/wakeup_devices; the table may well outgrow a sysfs page on large servers */
+static void *wake_devs_seq_start(struct seq_file *m, loff_t *pos)
+{
+	mutex_lock(&wake_devs_lock);
+	if (!*pos) return SEQ_START_TOKEN;
+	return *pos <= wake_devs_count ? &wake_devs[*pos - 1] : NULL;
+}
+
+static void *wake_devs_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	++*pos;
+	return *pos <= wake_devs_count ? &wake_devs[*pos - 1] : NULL;
+}
+
+static void wake_devs_seq_stop(struct seq_file *m, void *v)
+{
+	mutex_unlock(&wake_devs_lock);
+}
+
+static int wake_devs_seq_show(struct seq_file *m, void *v)
+{
+	const struct wake_dev *wd = v;
+	struct acpi_buffer path = { ACPI_ALLOCATE_BUFFER, NULL };
+	char gpe_dev[5] = "FADT";
+	struct acpi_buffer gpe_name = { sizeof(gpe_dev), gpe_dev };
+
+	if (v == SEQ_START_TOKEN) {
+		seq_printf(m, "%-4s\t%-24s\t%-9s\t%-12s\t%-5s\t%-7s\t%-6s\t%-5s\t%-6s\t%s\t%s\n",
+			"name", "path", "hid", "gpe", "sleep", "enabled", "method", "armed", "rc", "method_us", "mask_us");
+		return 0;
+	}
+
+	acpi_get_name(wd->handle, ACPI_FULL_PATHNAME, &path);
+	// GPEs not in the FADT blocks belong to a GPE block device
+	if (wd->gpe_device) acpi_get_name(wd->gpe_device, ACPI_SINGLE_NAME, &gpe_name);
+
+	seq_printf(m, "%-4s\t%-24s\t%-9s\t%s:0x%02x\tS%-4u\t%-7s\t%-6s\t%-5d\t%-6d\t%lld\t%lld\n",
+		wd->name, path.pointer ? (char *)path.pointer : "?", wd->hid, gpe_dev, wd->gpe_number,
+		wd->adev->wakeup.sleep_state, device_may_wakeup(&wd->adev->dev) ? "enabled" : "disabled",
+		wd->has_dsw ? "_DSW" : "_PSW", wd->armed, wd->rc, wd->method_us, wd->mask_us);
+	ACPI_FREE(path.pointer);
+	return 0;
+}
+
+static const struct seq_operations wake_devs_seq_ops = {
+	.start = wake_devs_seq_start,
+	.next = wake_devs_seq_next,
+	.stop = wake_devs_seq_stop,
+	.show = wake_devs_seq_show,
+};
+
+/*
+ * Firmware doesn't tell us when it is ready to sleep, but an armed wake GPE
+ * that is still asserted would wake the system right away. So rather than
+ * sleeping blindly, wait at most ms for the armed GPEs to go quiet.
+ */
+static void wake_gpes_settle(unsigned int ms)
+{
+	unsigned long deadline = jiffies + msecs_to_jiffies(ms);
+	acpi_event_status es;
+	bool pending;
+	unsigned int i;
+
+	if (!ms) return;
+	do {
+		pending = false;
+		mutex_lock(&wake_devs_lock);
+		for (i = 0; i < wake_devs_count; i++) {
+			if (!wake_devs[i].armed) continue;
+			if (ACPI_FAILURE(acpi_get_gpe_status(wake_devs[i].gpe_device, wake_devs[i].gpe_number, &es))) continue;
+			if (es & ACPI_EVENT_FLAG_STATUS_SET) pending = true;
+		}
+		mutex_unlock(&wake_devs_lock);
+		if (!pending) return;
+		msleep(10);
+	} while (time_before(jiffies, deadline));
+	pr_warn("s5divert: Wakeup GPEs still pending after %ums, system may wake up right away\n", ms);
+}
+
+/*
+ * What woke the system up from a diverted S4/S3. Without a waking vector,
+ * that is a fresh boot, but firmware leaves the status bits of the wake
+ * event latched. Events the kernel handles itself have usually been cleared
+ * by the time the module is loaded: rtc-cmos clears the RTC event when it
+ * sets it up, the button driver PWRBTN_STS once it enables the power button,
+ * and GPEs enabled at runtime, e.g. those of the EC, are cleared as they
+ * are handled. Those are listed as handled, as any of them may be the
+ * reason that shows up as unknown. Latched GPEs of the FADT blocks that no
+ * wakeup device claims are listed by number, e.g. G6D. Counts are kept in an EFI variable along
+ * with the timeline.
+ */
+#define WAKE_REASON_MAGIC 0x52443553	/* "S5DR" */
+#define WAKE_REASON_VERSION 1
+#define WAKE_REASONS 16
+#define WAKE_REASON_FIXED U32_MAX	/* gpe_number of fixed events */
+
+struct wake_reason {
+	char name[5];
+	acpi_handle gpe_device;
+	u32 gpe_number;
+};
+
+struct wake_reason_count {
+	char name[5];
+	u8 pad[3];
+	u32 count;
+} __packed;
+
+struct wake_reason_stats {
+	u32 magic;
+	u8 version;
+	u8 pad[3];
+	u32 boots;		/* after a diversion to S4/S3 */
+	u32 unknown;		/* of which none of the status bits told why */
+	struct wake_reason_count counts[WAKE_REASONS];
+} __packed;
+
+static struct wake_reason wake_reasons[WAKE_REASONS];
+static unsigned int wake_reasons_count = 0;
+/* Events with a handler in the kernel and their status bit clear */
+static struct wake_reason wake_handled[WAKE_REASONS];
+static unsigned int wake_handled_count = 0;
+static bool wake_status = false;
+static bool wake_after_sleep = false;
+static struct wake_reason_stats wake_reason_stats;
+static DEFINE_MUTEX(wake_reason_lock);
+static efi_char16_t wake_reason_efi_name[] = L"S5DivertWakeReasons";
+
+static void wake_reason_add(struct wake_reason *list, unsigned int *count, const char *name, acpi_handle gpe_device, u32 gpe_number)
+{
+	struct wake_reason *wr;
+
+	if (*count == WAKE_REASONS) return;
+	wr = &list[(*count)++];
+	strscpy(wr->name, name, sizeof(wr->name));
+	wr->gpe_device = gpe_device;
+	wr->gpe_number = gpe_number;
+}
+
+#if IS_ENABLED(CONFIG_RTC_CLASS)
+/* Whether the status bit of a wake event was found set, by name; asked for the S3S4 alarm only */
+static bool wake_reason_latched(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < wake_reasons_count; i++) {
+		if (!strncmp(wake_reasons[i].name, name, sizeof(wake_reasons[i].name))) return true;
+	}
+	return false;
+}
+
+/* Whether a wake event handled by the kernel may be what set WAK_STS, with its status bit cleared since */
+static bool wake_reason_cleared(const char *name)
+{
+	unsigned int i;
+
+	if (!wake_status || wake_reasons_count) return false;
+	for (i = 0; i < wake_handled_count; i++) {
+		if (!strncmp(wake_handled[i].name, name, sizeof(wake_handled[i].name))) return true;
+	}
+	return false;
+}
+#endif
+
+static void wake_reason_fixed(const char *name, u32 event)
+{
+	acpi_event_status es;
+
+	if (ACPI_FAILURE(acpi_get_event_status(event, &es))) return;
+	if (es & ACPI_EVENT_FLAG_STATUS_SET)
+		wake_reason_add(wake_reasons, &wake_reasons_count, name, NULL, WAKE_REASON_FIXED);
+	else if (es & ACPI_EVENT_FLAG_HAS_HANDLER)
+		wake_reason_add(wake_handled, &wake_handled_count, name, NULL, WAKE_REASON_FIXED);
+}
+
+static bool wake_reason_gpe_listed(u32 gpe_number)
+{
+	unsigned int i;
+
+	for (i = 0; i < wake_reasons_count; i++) {
+		if (!wake_reasons[i].gpe_device && wake_reasons[i].gpe_number == gpe_number) return true;
+	}
+	return false;
+}
+
+static void wake_reason_capture_gpes(u32 base, u32 count)
+{
+	acpi_event_status es;
+	char name[5];
+	u32 n;
+
+	for (n = base; n < base + count; n++) {
+		if (ACPI_FAILURE(acpi_get_gpe_status(NULL, n, &es)) || !(es & ACPI_EVENT_FLAG_STATUS_SET)) continue;
+		if (wake_reason_gpe_listed(n)) continue;
+		snprintf(name, sizeof(name), "G%02X", n);
+		wake_reason_add(wake_reasons, &wake_reasons_count, name, NULL, n);
+	}
+}
+
+/* Reads PM1 and the GPEs of all wakeup devices; called right after the first wake_devs_refresh() */
+static void wake_reason_capture(void)
+{
+	acpi_event_status es;
+	unsigned int i;
+	u32 v;
+
+	if (ACPI_SUCCESS(acpi_read_bit_register(ACPI_BITREG_WAKE_STATUS, &v))) wake_status = v;
+	wake_reason_fixed("PWRB", ACPI_EVENT_POWER_BUTTON);
+	wake_reason_fixed("SLPB", ACPI_EVENT_SLEEP_BUTTON);
+	wake_reason_fixed("RTC", ACPI_EVENT_RTC);
+
+	// Devices sharing a GPE are all listed, as there is no telling them apart
+	mutex_lock(&wake_devs_lock);
+	for (i = 0; i < wake_devs_count; i++) {
+		const struct wake_dev *wd = &wake_devs[i];
+
+		if (ACPI_FAILURE(acpi_get_gpe_status(wd->gpe_device, wd->gpe_number, &es))) continue;
+		if (es & ACPI_EVENT_FLAG_STATUS_SET)
+			wake_reason_add(wake_reasons, &wake_reasons_count, wd->name, wd->gpe_device, wd->gpe_number);
+		else if ((es & ACPI_EVENT_FLAG_HAS_HANDLER) && (es & ACPI_EVENT_FLAG_ENABLED))
+			wake_reason_add(wake_handled, &wake_handled_count, wd->name, wd->gpe_device, wd->gpe_number);
+	}
+	mutex_unlock(&wake_devs_lock);
 
-static struct proc_dir_entry *proc_dir_s5divert = NULL;
-static struct proc_dir_entry *proc_file_s5divert_enabled = NULL;
-static struct proc_dir_entry *proc_file_s5divert_poweroff = NULL;
-static struct proc_dir_entry *proc_file_s5divert_reboot = NULL;
-static struct proc_dir_entry *proc_file_s5divert_stroff = NULL;
+	// Half of each block is status, half enable registers, 8 GPEs a byte
+	wake_reason_capture_gpes(0, acpi_gbl_FADT.gpe0_block_length * 4);
+	wake_reason_capture_gpes(acpi_gbl_FADT.gpe1_base, acpi_gbl_FADT.gpe1_block_length * 4);
+}
 
-static struct kobject *sysfs_dir_s5divert = NULL;
+static void wake_reason_stats_init(void)
+{
+	memset(&wake_reason_stats, 0, sizeof(wake_reason_stats));
+	wake_reason_stats.magic = WAKE_REASON_MAGIC;
+	wake_reason_stats.version = WAKE_REASON_VERSION;
+}
 
-//static struct workqueue_struct *wq = NULL;
-//static void wq_worker(struct work_struct *work);
-//static DECLARE_WORK(wq_work, wq_worker);
+static void wake_reason_stats_add(const char *name)
+{
+	struct wake_reason_count *wc;
+	int i;
 
-static void system_poweroff(void);
-static void system_reboot(bool hard);
+	// The last slot takes whatever doesn't fit anymore
+	for (i = 0; i < WAKE_REASONS - 1; i++) {
+		wc = &wake_reason_stats.counts[i];
+		if (!wc->count || !strncmp(wc->name, name, sizeof(wc->name))) break;
+	}
+	wc = &wake_reason_stats.counts[i];
+	if (!wc->count) strscpy(wc->name, i < WAKE_REASONS - 1 ? name : "*", sizeof(wc->name));
+	wc->count++;
+}
 
-static int acpi_call_dsw_or_psw(acpi_handle handle, u8 enable, u8 sstate, u8 dstate)
+/* The mode the last shutdown ended up in, i.e. the last fallback tried, if any */
+static u8 last_shutdown_mode(void)
 {
-    if (acpi_has_method(handle, "_DSW")) {
-        union acpi_object in[3] = {
-            { .type = ACPI_TYPE_INTEGER, .integer.value = enable },  // 1 = enable
-            { .type = ACPI_TYPE_INTEGER, .integer.value = sstate  }, // e.g. ACPI_STATE_S4
-            { .type = ACPI_TYPE_INTEGER, .integer.value = dstate  }, // e.g. D3hot
-        };
-        struct acpi_object_list args = { .count = 3, .pointer = in };
-	    pr_info("s5divert: Calling _DSW\n");
-		msleep(5000);
-        return ACPI_SUCCESS(acpi_evaluate_object(handle, "_DSW", &args, NULL)) ? 0 : -EIO;
-    }
-    pr_info("s5divert: Calling _PSW\n");
-    return ACPI_SUCCESS(acpi_execute_simple_method(handle, "_PSW", enable)) ? 0 : -EIO;
+	const struct s5divert_timeline *tl = &last_shutdown;
+	return tl->nattempts ? tl->attempts[tl->nattempts - 1].mode : tl->mode;
 }
 
-static const struct acpi_device_id lid_ids[] = {
-    { "PNP0C0D", 0 },     /* ACPI Lid device */
-    { }
-};
+/* Whether the last shutdown went to S4/S3 rather than to a reboot or S5; needs last_shutdown_load() */
+static bool last_shutdown_slept(void)
+{
+	const struct s5divert_timeline *tl = &last_shutdown;
 
-static bool is_lid_device(struct acpi_device *adev)
+	if (!last_shutdown_valid || !(tl->entered & BIT(PHASE_SLEEP)) || !mode_is_sleep(last_shutdown_mode())) return false;
+	if (tl->nattempts) return !tl->attempts[tl->nattempts - 1].done;
+	return tl->failed == PHASE_NONE;
+}
+
+static void wake_reason_account(void)
 {
-    return acpi_match_device_ids(adev, lid_ids) == 0;
+	unsigned int i;
+	int ret;
+
+	mutex_lock(&wake_reason_lock);
+	if (efivar_load(wake_reason_efi_name, &wake_reason_stats, sizeof(wake_reason_stats)) ||
+	    wake_reason_stats.magic != WAKE_REASON_MAGIC || wake_reason_stats.version != WAKE_REASON_VERSION)
+		wake_reason_stats_init();
+
+	wake_after_sleep = last_shutdown_slept();
+	if (!wake_after_sleep) goto out;
+
+	wake_reason_stats.boots++;
+	if (!wake_reasons_count) wake_reason_stats.unknown++;
+	for (i = 0; i < wake_reasons_count; i++) wake_reason_stats_add(wake_reasons[i].name);
+	if (!efi_records_enabled()) goto out;
+	ret = efivar_store(wake_reason_efi_name, &wake_reason_stats, sizeof(wake_reason_stats));
+	if (ret && ret != -EOPNOTSUPP) {
+		pr_warn("s5divert: Unable to store the wake reasons: %pe\n", ERR_PTR(ret));
+		status_error("wake_reason", ret);
+	}
+out:
+	mutex_unlock(&wake_reason_lock);
 }
 
-static acpi_status enable_wake_gpe_cb(acpi_handle handle, u32 lvl, void *context, void **rv)
+static void wake_reason_reset(void)
 {
-	struct acpi_device *adev = acpi_fetch_acpi_dev(handle);
-	if (!adev) return AE_OK;
+	mutex_lock(&wake_reason_lock);
+	wake_reason_stats_init();
+	efivar_store(wake_reason_efi_name, NULL, 0);
+	mutex_unlock(&wake_reason_lock);
+}
 
-	if (adev->wakeup.flags.valid && device_may_wakeup(&adev->dev)) {
-		acpi_call_dsw_or_psw(handle, 1, ACPI_STATE_S4, ACPI_STATE_D3_HOT);
-		acpi_set_gpe_wake_mask(adev->wakeup.gpe_device, adev->wakeup.gpe_number, ACPI_GPE_ENABLE);
-		if (is_lid_device(adev)) {
-			pr_debug("s5divert: Wakeup from lid enabled\n");
-			lid_found = true;
-		}
-	} else {
-		if (is_lid_device(adev)) {
-			pr_debug("s5divert: Wakeup from lid not enabled\n");
-			lid_found = true;
+static int wake_reason_show(char *buf)
+{
+	const struct wake_reason_stats *st = &wake_reason_stats;
+	int i, len = 0;
+
+	len += sysfs_emit_at(buf, len, "after=%s wak_sts=%d\n", wake_after_sleep ? mode_names[last_shutdown_mode()] : "none", wake_status);
+	if (!wake_reasons_count) len += sysfs_emit_at(buf, len, "reason=unknown\n");
+	// Their bits may have been cleared before the module was loaded
+	if (wake_handled_count) {
+		len += sysfs_emit_at(buf, len, "handled=");
+		for (i = 0; i < wake_handled_count; i++)
+			len += sysfs_emit_at(buf, len, "%s%s", i ? "," : "", wake_handled[i].name);
+		len += sysfs_emit_at(buf, len, "\n");
+	}
+	for (i = 0; i < wake_reasons_count; i++) {
+		const struct wake_reason *wr = &wake_reasons[i];
+		char gpe_dev[5] = "FADT";
+		struct acpi_buffer gpe_name = { sizeof(gpe_dev), gpe_dev };
+
+		if (wr->gpe_number == WAKE_REASON_FIXED) {
+			len += sysfs_emit_at(buf, len, "reason=%s source=PM1\n", wr->name);
+			continue;
 		}
+		// GPEs not in the FADT blocks belong to a GPE block device
+		if (wr->gpe_device) acpi_get_name(wr->gpe_device, ACPI_SINGLE_NAME, &gpe_name);
+		len += sysfs_emit_at(buf, len, "reason=%s source=%s:0x%02x\n", wr->name, gpe_dev, wr->gpe_number);
 	}
 
-	return AE_OK;
+	mutex_lock(&wake_reason_lock);
+	len += sysfs_emit_at(buf, len, "boots=%u unknown=%u\n", st->boots, st->unknown);
+	for (i = 0; i < WAKE_REASONS; i++) {
+		if (st->counts[i].count) len += sysfs_emit_at(buf, len, "wake=%.4s count=%u\n", st->counts[i].name, st->counts[i].count);
+	}
+	mutex_unlock(&wake_reason_lock);
+	return len;
 }
 
-static void acpi_enable_wakeup_devices(void)
+/*
+ * There is no exported way to walk all superblocks, and the caller's mount
+ * table misses other namespaces and overmounted filesystems. So sync=all
+ * goes through ksys_sync_helper(), i.e. sync(2), which covers all of them
+ * and has the flusher threads write back every disc in parallel. sync=root
+ * syncs just the root filesystem and flushes the disc cache behind it.
+ * Holding s_umount like sync(2) does keeps sync_filesystem() from
+ * complaining. sync(2) does not tell which disc took how long, so the
+ * fs_sync phase is all there is to trace.
+ */
+static int fs_sync_root(void)
 {
-	lid_found = false;
-	acpi_walk_namespace(ACPI_TYPE_DEVICE, ACPI_ROOT_OBJECT, ACPI_UINT32_MAX, enable_wake_gpe_cb, NULL, NULL, NULL);
-	if(!lid_found) pr_debug("s5divert: No lid wakeup source found\n");
+	struct path root;
+	struct super_block *sb;
+	ktime_t start = ktime_get();
+	s64 us;
+	int rc;
+
+	get_fs_root(current->fs, &root);
+	sb = root.mnt->mnt_sb;
+	down_read(&sb->s_umount);
+	rc = sync_filesystem(sb);
+	up_read(&sb->s_umount);
+	if (!rc && sb->s_bdev) rc = blkdev_issue_flush(sb->s_bdev);
+	us = ktime_us_delta(ktime_get(), start);
+	if (rc) pr_warn("s5divert: Syncing %s (%pg) failed: %pe\n", sb->s_id, sb->s_bdev, ERR_PTR(rc));
+	else pr_info("s5divert: Synced %s (%pg) in %lld.%03lld ms\n", sb->s_id, sb->s_bdev, us / 1000, us % 1000);
+	path_put(&root);
+	return rc;
 }
 
-static inline void fs_sync(void)
+static void fs_sync(const struct s5divert_config *cfg)
 {
-    struct path root;
+	u8 mode = cfg->sync;
+	ktime_t start;
+	int rc = 0;
 
-	pr_info("s5divert: Syncing discs... (expect a kernel waring from sync_filesystem)\n");
-	get_fs_root(current->fs, &root);
-    if (root.mnt && root.mnt->mnt_sb) {
-        struct super_block *sb = root.mnt->mnt_sb;
-        struct block_device *bdev = sb->s_bdev;
-        sync_filesystem(sb);	// this will throw an ugly warning. SIGH.
-        if (bdev) {
-			sync_blockdev(bdev);
-            blkdev_issue_flush(bdev);
-		}
-        msleep(100);
-    }
-    path_put(&root);
+	if (mode == SYNC_NONE) return;
+
+	pr_info("s5divert: Syncing discs...\n");
+	phase_enter(PHASE_FS_SYNC, mode);
+	start = ktime_get();
+	if (mode == SYNC_ALL) ksys_sync_helper();
+	else rc = fs_sync_root();
+	phase_exit(PHASE_FS_SYNC, rc);
+
+	pr_info("s5divert: Synced discs in %lld ms\n", ktime_ms_delta(ktime_get(), start));
+	settle("sync", cfg->sync_delay_ms);
 }
 
-static int enter_s4_noimage(void)
+static void acpi_tts(u8 sstate)
 {
 	acpi_status st;
 
-	pr_info("s5divert: Entering ACPI S4 without hibernation...\n");
-    acpi_execute_simple_method(NULL, "\\_TTS", ACPI_STATE_S4);
-    acpi_enable_wakeup_devices();
-	// acpi_execute_simple_method(NULL, "\\_PTS", ACPI_STATE_S4); // included in acpi_enter_sleep_state_prep
-	st = acpi_enter_sleep_state_prep(ACPI_STATE_S4);
+	phase_enter(PHASE_TTS, sstate);
+	st = acpi_execute_simple_method(NULL, "\\_TTS", sstate);
+	phase_exit(PHASE_TTS, st);
+}
+
+/*
+ * The sleep state acpi_enter_sleep_state_prep() last went for, 0 if none.
+ * ACPICA keeps its sleep type for acpi_enter_sleep_state(), and _WAK
+ * invalidates it, so acpi_power_off() needs S5 prepared again afterwards.
+ */
+static u8 sleep_prepped = 0;
+
+/* Publishes sstate as prepared, unless current is an abandoned worker */
+static bool sleep_prepped_set(u8 sstate)
+{
+	unsigned long flags;
+	bool ok;
+
+	spin_lock_irqsave(&divert_job_lock, flags);
+	ok = !divert_job_abandoned_locked();
+	if (ok) sleep_prepped = sstate;
+	spin_unlock_irqrestore(&divert_job_lock, flags);
+	return ok;
+}
+
+/*
+ * Everything ahead of acpi_enter_sleep_state(): _TTS, arming wakeup
+ * devices, and _PTS along with resolving the sleep type. All of it has to
+ * follow device_shutdown(): drivers' shutdown hooks may disable the wakeups
+ * of their devices, and ACPI's own power off preparation, which runs right
+ * before sysoff_hook_cb(), resolves the sleep type for S5 and runs _PTS(5).
+ */
+static int acpi_sleep_prepare(const struct s5divert_config *cfg, u8 sstate)
+{
+	acpi_status st;
+
+	acpi_tts(sstate);
+	// Late after all; the diversion has moved on
+	if (divert_job_abandoned()) return -ETIMEDOUT;
+	acpi_enable_wakeup_devices(cfg);
+	if (divert_job_abandoned()) return -ETIMEDOUT;
+	// acpi_execute_simple_method(NULL, "\\_PTS", sstate); // included in acpi_enter_sleep_state_prep
+	phase_enter(PHASE_SLEEP_PREP, sstate);
+	if (!sleep_prepped_set(sstate)) return -ETIMEDOUT;
+	st = acpi_enter_sleep_state_prep(sstate);
+	phase_exit(PHASE_SLEEP_PREP, st);
 	if (ACPI_FAILURE(st)) {
-		pr_err("s5divert: Unable to enter ACPI S4, proceeding to ACPI S5\n");
+		phase_failed(PHASE_SLEEP_PREP);
 		return -EOPNOTSUPP;
 	}
-	msleep(300);
+	return 0;
+}
+
+/* Backs out of a sleep state that was prepared but not entered, so that the next step starts over */
+static void acpi_sleep_leave(u8 sstate)
+{
+	acpi_leave_sleep_state_prep(sstate);
+    // acpi_execute_simple_method(NULL, "\\_BFS", sstate); // deprecated
+	acpi_leave_sleep_state(sstate);
+    // acpi_execute_simple_method(NULL, "\\_WAK", sstate); // included in acpi_leave_sleep_state
+	acpi_execute_simple_method(NULL, "\\_TTS", ACPI_STATE_S0);
+}
+
+/*
+ * With deadline_ms set, each preparation runs on a workqueue, so that AML
+ * hanging in _TTS, _DSW or _PTS cannot keep the diversion from falling
+ * back. The work goes to a system workqueue, since the poweroff trigger may
+ * be running on ours.
+ */
+enum { PREP_NONE, PREP_QUEUED, PREP_DONE, PREP_HUNG };
+
+static struct s5divert_config divert_cfg;
+static u8 divert_mode;
+static bool divert_early = false;
+static u8 prep_state = PREP_NONE;
+static u8 prep_sstate;
+static int prep_rc;
+static DECLARE_COMPLETION(prep_done);
+
+static void prep_worker(struct work_struct *work)
+{
+	int rc = acpi_sleep_prepare(&divert_cfg, prep_sstate);
+	unsigned long flags;
+
+	spin_lock_irqsave(&divert_job_lock, flags);
+	if (!prep_abandoned) {
+		prep_rc = rc;
+		complete(&prep_done);
+	}
+	spin_unlock_irqrestore(&divert_job_lock, flags);
+}
+
+static DECLARE_WORK(prep_work, prep_worker);
+
+/* Queues the preparation of sstate */
+static void prep_queue(u8 sstate)
+{
+	prep_sstate = sstate;
+	prep_state = PREP_QUEUED;
+	prep_abandoned = false;
+	reinit_completion(&prep_done);
+	queue_work(system_highpri_wq, &prep_work);
+}
+
+/* Waits for the queued preparation for up to timeout jiffies, 0 for no limit */
+static int prep_wait(unsigned long timeout)
+{
+	if (!timeout) {
+		wait_for_completion(&prep_done);
+	} else if (!wait_for_completion_timeout(&prep_done, timeout)) {
+		divert_job_abandon(&prep_abandoned);
+		// Unless it has made it just in time, the worker is stuck in AML and holds the interpreter
+		if (!try_wait_for_completion(&prep_done)) {
+			prep_state = PREP_HUNG;
+			return -ETIMEDOUT;
+		}
+	}
+	prep_state = PREP_DONE;
+	return prep_rc;
+}
+
+static int acpi_sleep_prepared(const struct s5divert_config *cfg, u8 sstate, unsigned long timeout)
+{
+	if (prep_state == PREP_HUNG) return -ETIMEDOUT;
+	prep_state = PREP_NONE;
+	if (!timeout) return acpi_sleep_prepare(cfg, sstate);
+	prep_queue(sstate);
+	return prep_wait(timeout);
+}
+
+static DECLARE_COMPLETION(sync_done);
+
+static void sync_worker(struct work_struct *work)
+{
+	fs_sync(&divert_cfg);
+	complete(&sync_done);
+}
+
+static DECLARE_WORK(sync_work, sync_worker);
+
+/* fs_sync() for up to timeout jiffies, 0 for no limit; a sync that hangs, e.g. on a dead NFS server, is left behind */
+static void fs_sync_bounded(const struct s5divert_config *cfg, unsigned long timeout)
+{
+	if (!timeout || cfg->sync == SYNC_NONE) {
+		fs_sync(cfg);
+		return;
+	}
+	reinit_completion(&sync_done);
+	queue_work(system_unbound_wq, &sync_work);
+	if (wait_for_completion_timeout(&sync_done, timeout)) return;
+	divert_job_abandon(&sync_abandoned);
+	if (try_wait_for_completion(&sync_done)) return;
+	phase_exit(PHASE_FS_SYNC, -ETIMEDOUT);
+	pr_err("s5divert: Syncing discs timed out after %u ms, going on without\n", cfg->deadline_ms);
+}
+
+static int enter_s4_noimage(const struct s5divert_config *cfg, unsigned long timeout)
+{
+	acpi_status st;
+	int ret;
+
+	pr_info("s5divert: Entering ACPI S4 without hibernation...\n");
+	if ((ret = acpi_sleep_prepared(cfg, ACPI_STATE_S4, timeout))) {
+		pr_err("s5divert: Unable to prepare ACPI S4: %pe\n", ERR_PTR(ret));
+		// Unless AML is stuck, _PTS may have run, or at least _TTS
+		if (prep_state != PREP_HUNG) acpi_sleep_leave(ACPI_STATE_S4);
+		return ret;
+	}
+	phase_store_final(PHASE_SLEEP);
+	wake_gpes_settle(cfg->prep_delay_ms);
     // acpi_execute_simple_method(NULL, "\\_GTS", ACPI_STATE_S4); // deprecated
+	phase_enter(PHASE_SLEEP, ACPI_STATE_S4);
 	local_irq_disable();
 	st = acpi_enter_sleep_state(ACPI_STATE_S4);
 	local_irq_enable();
-	acpi_leave_sleep_state_prep(ACPI_STATE_S4);
-    // acpi_execute_simple_method(NULL, "\\_BFS", ACPI_STATE_S4); // deprecated
-	acpi_leave_sleep_state(ACPI_STATE_S4);
-    // acpi_execute_simple_method(NULL, "\\_WAK", ACPI_STATE_S4); // included in acpi_leave_sleep_state
+	phase_exit(PHASE_SLEEP, st);
+	phase_failed(PHASE_SLEEP);
+	acpi_sleep_leave(ACPI_STATE_S4);
 
 	if (ACPI_SUCCESS(st)) {
 		pr_err("s5divert: ACPI S4 returned unexpectedly\n");
@@ -168,28 +2234,28 @@ static int enter_s4_noimage(void)
 	return -EIO;
 }
 
-static int enter_s3_noreturn(void)
+static int enter_s3_noreturn(const struct s5divert_config *cfg, unsigned long timeout)
 {
 	acpi_status st;
+	int ret;
 
 	pr_info("s5divert: Entering ACPI S3 without return point...\n");
-    acpi_execute_simple_method(NULL, "\\_TTS", ACPI_STATE_S3);
-    acpi_enable_wakeup_devices();
-	// acpi_execute_simple_method(NULL, "\\_PTS", ACPI_STATE_S3); // included in acpi_enter_sleep_state_prep
-	st = acpi_enter_sleep_state_prep(ACPI_STATE_S3);
-	if (ACPI_FAILURE(st)) {
-		pr_err("s5divert: Unable to enter ACPI S3, proceeding to ACPI S5\n");
-		return -EOPNOTSUPP;
+	if ((ret = acpi_sleep_prepared(cfg, ACPI_STATE_S3, timeout))) {
+		pr_err("s5divert: Unable to prepare ACPI S3: %pe\n", ERR_PTR(ret));
+		// Unless AML is stuck, _PTS may have run, or at least _TTS
+		if (prep_state != PREP_HUNG) acpi_sleep_leave(ACPI_STATE_S3);
+		return ret;
 	}
-	msleep(300);
+	phase_store_final(PHASE_SLEEP);
+	wake_gpes_settle(cfg->prep_delay_ms);
     // acpi_execute_simple_method(NULL, "\\_GTS", ACPI_STATE_S3); // deprecated
+	phase_enter(PHASE_SLEEP, ACPI_STATE_S3);
 	local_irq_disable();
 	st = acpi_enter_sleep_state(ACPI_STATE_S3);
 	local_irq_enable();
-	acpi_leave_sleep_state_prep(ACPI_STATE_S3);
-    // acpi_execute_simple_method(NULL, "\\_BFS", ACPI_STATE_S3); // deprecated
-	acpi_leave_sleep_state(ACPI_STATE_S3);
-    // acpi_execute_simple_method(NULL, "\\_WAK", ACPI_STATE_S3); // included in acpi_leave_sleep_state
+	phase_exit(PHASE_SLEEP, st);
+	phase_failed(PHASE_SLEEP);
+	acpi_sleep_leave(ACPI_STATE_S3);
 
 	if (ACPI_SUCCESS(st)) {
 		pr_err("s5divert: ACPI S3 returned unexpectedly\n");
@@ -199,23 +2265,260 @@ static int enter_s3_noreturn(void)
 	return -EIO;
 }
 
+/*
+ * Statistics of stroff cycles. The system reboots right after each of
+ * them, so they are kept in an EFI variable along with the timeline.
+ * Histograms are log2 of milliseconds: bucket 0 counts intervals below
+ * 1 ms, bucket k those from 2^(k-1) up to 2^k ms.
+ */
+enum { STROFF_ENTRY, STROFF_ASLEEP, STROFF_RESUME, STROFF_INTERVALS };
+static const char * const stroff_interval_names[STROFF_INTERVALS] = { "entry", "asleep", "resume" };
+
+#define STROFF_STATS_MAGIC 0x53443553	/* "S5DS" */
+#define STROFF_STATS_VERSION 1
+#define STROFF_HIST_BUCKETS 32
+#define STROFF_ERRORS 8
+
+struct stroff_stats {
+	u32 magic;
+	u8 version;
+	u8 pad[3];
+	u32 cycles;
+	u32 failures;
+	u64 sum_ms[STROFF_INTERVALS];
+	u32 max_ms[STROFF_INTERVALS];
+	u32 hist[STROFF_INTERVALS][STROFF_HIST_BUCKETS];
+	struct {
+		s32 err;
+		u32 count;
+	} errors[STROFF_ERRORS];
+} __packed;
+
+static struct stroff_stats stroff_stats;
+static DEFINE_MUTEX(stroff_stats_lock);
+static efi_char16_t stroff_stats_efi_name[] = L"S5DivertStroffStats";
+
+/* Boot time stamps of a stroff cycle, the middle two taken by syscore ops */
+static bool stroff_in_progress = false;
+static bool stroff_fast_reset = false;
+static ktime_t stroff_t_begin, stroff_t_suspend, stroff_t_resume;
+
+static void stroff_reset_now(void);
+
+/*
+ * The resume hook also runs if the suspend was aborted after the syscore
+ * suspend hooks, e.g. by a pending wakeup event, another syscore hook or
+ * the platform failing to enter S3. WAK_STS is cleared on the way down and
+ * only set again by the firmware waking up from a sleep state.
+ */
+static int stroff_syscore_suspend(void)
+{
+	if (!READ_ONCE(stroff_in_progress)) return 0;
+	stroff_t_suspend = ktime_get_boottime();
+	acpi_write_bit_register(ACPI_BITREG_WAKE_STATUS, ACPI_CLEAR_STATUS);
+	return 0;
+}
+
+static bool stroff_woke_up(void)
+{
+	u32 v;
+
+	return ACPI_SUCCESS(acpi_read_bit_register(ACPI_BITREG_WAKE_STATUS, &v)) && v;
+}
+
+static void stroff_syscore_resume(void)
+{
+	if (!READ_ONCE(stroff_in_progress)) return;
+	stroff_t_resume = ktime_get_boottime();
+	if (READ_ONCE(stroff_fast_reset) && stroff_woke_up()) stroff_reset_now();
+}
+
+static void stroff_syscore_shutdown(void);
+
+static struct syscore_ops stroff_syscore_ops = {
+	.suspend = stroff_syscore_suspend,
+	.resume = stroff_syscore_resume,
+	.shutdown = stroff_syscore_shutdown,
+};
+
+static void stroff_stats_init(void)
+{
+	memset(&stroff_stats, 0, sizeof(stroff_stats));
+	stroff_stats.magic = STROFF_STATS_MAGIC;
+	stroff_stats.version = STROFF_STATS_VERSION;
+}
+
+static void stroff_stats_load(void)
+{
+	mutex_lock(&stroff_stats_lock);
+	if (efivar_load(stroff_stats_efi_name, &stroff_stats, sizeof(stroff_stats)) ||
+	    stroff_stats.magic != STROFF_STATS_MAGIC || stroff_stats.version != STROFF_STATS_VERSION)
+		stroff_stats_init();
+	mutex_unlock(&stroff_stats_lock);
+}
+
+static void stroff_stats_add(u8 interval, ktime_t from, ktime_t to)
+{
+	s64 ms = max_t(s64, ktime_ms_delta(to, from), 0);
+	u32 bucket = ms ? min_t(u32, fls64(ms), STROFF_HIST_BUCKETS - 1) : 0;
+
+	stroff_stats.hist[interval][bucket]++;
+	stroff_stats.sum_ms[interval] += ms;
+	stroff_stats.max_ms[interval] = max_t(u32, stroff_stats.max_ms[interval], min_t(s64, ms, U32_MAX));
+}
+
+static void stroff_stats_add_error(int rc)
+{
+	int i;
+
+	stroff_stats.failures++;
+	for (i = 0; i < STROFF_ERRORS; i++) {
+		if (stroff_stats.errors[i].count && stroff_stats.errors[i].err != rc) continue;
+		stroff_stats.errors[i].err = rc;
+		stroff_stats.errors[i].count++;
+		return;
+	}
+	// All slots taken by other errors, count it with the last one
+	stroff_stats.errors[STROFF_ERRORS - 1].count++;
+}
+
+/* Accounts for one stroff cycle, rc being what pm_suspend() returned, with stroff_stats_lock held */
+static void stroff_stats_account(int rc, ktime_t now)
+{
+	if (rc) {
+		stroff_stats_add_error(rc);
+	} else if (stroff_t_suspend && stroff_t_resume) {
+		stroff_stats.cycles++;
+		stroff_stats_add(STROFF_ENTRY, stroff_t_begin, stroff_t_suspend);
+		stroff_stats_add(STROFF_ASLEEP, stroff_t_suspend, stroff_t_resume);
+		stroff_stats_add(STROFF_RESUME, stroff_t_resume, now);
+	}
+}
+
+static void stroff_stats_store_worker(struct work_struct *work)
+{
+	int ret;
+
+	mutex_lock(&stroff_stats_lock);
+	ret = efivar_store(stroff_stats_efi_name, &stroff_stats, sizeof(stroff_stats));
+	mutex_unlock(&stroff_stats_lock);
+	if (ret && ret != -EOPNOTSUPP) {
+		pr_warn("s5divert: Unable to store stroff statistics: %pe\n", ERR_PTR(ret));
+		status_error("stroff_stats", ret);
+	}
+}
+
+static DECLARE_WORK(stroff_stats_store_work, stroff_stats_store_worker);
+
+/*
+ * Writing the variable takes a while on some firmware, so it doesn't hold
+ * up the reboot after a cycle: it runs alongside the reboot notifiers and
+ * device_shutdown(), and the syscore shutdown hook waits for it before the
+ * platform is reset.
+ */
+static void stroff_stats_record(int rc)
+{
+	ktime_t now = ktime_get_boottime();
+
+	mutex_lock(&stroff_stats_lock);
+	stroff_stats_account(rc, now);
+	mutex_unlock(&stroff_stats_lock);
+	if (efi_records_enabled()) queue_work(system_unbound_wq, &stroff_stats_store_work);
+}
+
+static void stroff_syscore_shutdown(void)
+{
+	flush_work(&stroff_stats_store_work);
+}
+
+/*
+ * With stroff_fast, the platform is reset from the syscore resume hook,
+ * before any device has resumed only to be shut down again. Only one CPU
+ * is up and interrupts are still off, so nothing in here may sleep.
+ */
+static void stroff_reset_now(void)
+{
+	if (mutex_trylock(&stroff_stats_lock)) {
+		stroff_stats_account(0, ktime_get_boottime());
+		if (efi_records_enabled()) efivar_store_nonblocking(stroff_stats_efi_name, &stroff_stats, sizeof(stroff_stats));
+		mutex_unlock(&stroff_stats_lock);
+	}
+	system_reset(RESET_ACPI);
+}
+
+static void stroff_stats_reset(void)
+{
+	mutex_lock(&stroff_stats_lock);
+	stroff_stats_init();
+	efivar_store(stroff_stats_efi_name, NULL, 0);
+	mutex_unlock(&stroff_stats_lock);
+}
+
+static int stroff_stats_show(char *buf)
+{
+	const struct stroff_stats *st = &stroff_stats;
+	int i, b, len = 0;
+
+	mutex_lock(&stroff_stats_lock);
+	len += sysfs_emit_at(buf, len, "cycles=%u failures=%u\n", st->cycles, st->failures);
+	for (i = 0; i < STROFF_ERRORS; i++) {
+		if (st->errors[i].count) len += sysfs_emit_at(buf, len, "error=%pe count=%u\n", ERR_PTR(st->errors[i].err), st->errors[i].count);
+	}
+	for (i = 0; i < STROFF_INTERVALS; i++) {
+		len += sysfs_emit_at(buf, len, "%s avg_ms=%llu max_ms=%u hist_ms=", stroff_interval_names[i],
+			st->cycles ? div_u64(st->sum_ms[i], st->cycles) : 0, st->max_ms[i]);
+		// Lower bound of each non-empty bucket with its count
+		for (b = 0; b < STROFF_HIST_BUCKETS; b++) {
+			if (st->hist[i][b]) len += sysfs_emit_at(buf, len, "%llu:%u,", b ? 1ULL << (b - 1) : 0, st->hist[i][b]);
+		}
+		if (buf[len - 1] == ',') len--;
+		len += sysfs_emit_at(buf, len, "\n");
+	}
+	mutex_unlock(&stroff_stats_lock);
+	return len;
+}
+
+/*
+ * pm_suspend(PM_SUSPEND_MEM) enters S3 whatever /sys/power/mem_sleep says,
+ * which only applies to writes to /sys/power/state. Without S3, the kernel
+ * would refuse it anyway; s2idle is not an option, as it skips the syscore
+ * hooks that time a cycle and do the fast reset.
+ */
 static int enter_s3_reboot(void)
 {
+	struct s5divert_config cfg;
 	struct wakeup_source* ws;
+	u8 slp_typ_a, slp_typ_b;
 	int rc;
 
 	//if (WARN_ON_ONCE(irqs_disabled())) return -EINVAL;
 
+	if (ACPI_FAILURE(acpi_get_sleep_type_data(ACPI_STATE_S3, &slp_typ_a, &slp_typ_b))) {
+		pr_err("s5divert: No ACPI S3 on this platform, stroff does not go by s2idle\n");
+		return -EOPNOTSUPP;
+	}
+
 	pr_info("s5divert: Entering ACPI S3 just to reboot right after resuming...\n");
 
-	might_sleep(); set_freezable();
-	msleep(300);
+	might_sleep();
+	config_get(&cfg);
+	settle("stroff", cfg.stroff_delay_ms);
+	lid_wait(&cfg);
+	lid_wake_apply();
+	WRITE_ONCE(stroff_fast_reset, cfg.stroff_fast);
 
 	ws = wakeup_source_register(NULL, "enter_s3_guard");
 	if (!ws) return -ENOMEM;
 
 	__pm_stay_awake(ws);
+	stroff_t_suspend = stroff_t_resume = 0;
+	stroff_t_begin = ktime_get_boottime();
+	WRITE_ONCE(stroff_in_progress, true);
+	phase_enter(PHASE_PM_SUSPEND, PM_SUSPEND_MEM);
 	rc = pm_suspend(PM_SUSPEND_MEM);
+	phase_exit(PHASE_PM_SUSPEND, rc);
+	WRITE_ONCE(stroff_in_progress, false);
+	stroff_stats_record(rc);
 
 	if (rc == 0) {
 		pr_info("s5divert: Resumed from ACPI S3. Rebooting...\n");
@@ -225,97 +2528,377 @@ static int enter_s3_reboot(void)
 		pr_err("s5divert: Failed to enter ACPI S3 system state: %pe\n", ERR_PTR(rc));
 	}
 
-	__pm_relax(ws);
-	wakeup_source_unregister(ws);
+	__pm_relax(ws);
+	wakeup_source_unregister(ws);
+
+	return rc;
+}
+
+static void system_poweroff(void)
+{
+    kernel_power_off();
+    kernel_halt();
+}
+
+static void system_sync_poweroff(void)
+{
+	struct sys_off_handler *h = READ_ONCE(sysoff_hook_h);
+	struct s5divert_config cfg;
+
+	// Call fs_sync, iff sysoff_hook_cb is not installed.
+	// If so then it will be called later anyway.
+	if (h==NULL || IS_ERR(h)) {
+		config_get(&cfg);
+		fs_sync(&cfg);
+	}
+	system_poweroff();
+}
+
+static void system_reboot(bool hard)
+{
+    phase_store_final(PHASE_REBOOT);
+    phase_enter(PHASE_REBOOT, hard);
+    if (hard)	emergency_restart();
+    else 		kernel_restart(NULL);
+}
+
+/*
+ * Resets the platform right away, without kernel_restart() running the
+ * reboot notifiers and device_shutdown() all over again. Any method falls
+ * back to emergency_restart(); "restart" returns right away.
+ */
+static void system_reset(u8 method)
+{
+	if (method == RESET_RESTART) return;
+	phase_store_final(PHASE_REBOOT);
+	phase_enter(PHASE_REBOOT, method);
+	switch (method) {
+		case RESET_ACPI:
+		acpi_reset();
+		// No usable reset register, or it takes its time
+		mdelay(100);
+		break;
+
+		case RESET_EFI:
+		if (IS_ENABLED(CONFIG_EFI) && efi_rt_services_supported(EFI_RT_SUPPORTED_RESET_SYSTEM))
+			efi.reset_system(EFI_RESET_COLD, EFI_SUCCESS, 0, NULL);
+		break;
+
+		default:
+		break;
+	}
+	emergency_restart();
+}
+
+/*
+ * Modules have no way to kexec: kernel_kexec() is not exported. So with
+ * enabled=4, userspace does it from its shutdown hook, see s5divert.shutdown,
+ * and the system never gets here. If it does anyway, there was no image or
+ * no hook, and the diversion fails over to the fallbacks.
+ */
+static int system_kexec(void)
+{
+	phase_enter(PHASE_KEXEC, 0);
+	phase_exit(PHASE_KEXEC, -EOPNOTSUPP);
+	phase_failed(PHASE_KEXEC);
+	pr_err("s5divert: Userspace did not kexec, which takes kexec -e from its shutdown hook\n");
+	status_error("kexec", -EOPNOTSUPP);
+	return -EOPNOTSUPP;
+}
+
+static void trigger_status_set(u8 state, int rc)
+{
+	spin_lock(&trigger_lock);
+	// Once closed on unload, a trigger still in flight must not reopen it
+	if (trigger_state != TRIGGER_CLOSED) {
+		trigger_state = state;
+		trigger_rc = rc;
+	}
+	spin_unlock(&trigger_lock);
+	if (sysfs_dir_s5divert) sysfs_notify(sysfs_dir_s5divert, NULL, "trigger_status");
+	status_changed();
+}
+
+static int trigger_run(u8 which)
+{
+	int rc;
+
+	switch (which) {
+		case TRIGGER_POWEROFF:
+		system_sync_poweroff();
+		break;
+
+		case TRIGGER_REBOOT:
+		system_reboot(false);
+		break;
+
+		case TRIGGER_STROFF:
+		rc = enter_s3_reboot();
+		if (rc) return rc;
+		break;
+	}
+	// Whatever got here did not take the system down
+	return -EIO;
+}
+
+static void wq_worker(struct work_struct *work)
+{
+	u8 which;
+	int rc;
+
+	spin_lock(&trigger_lock);
+	which = trigger_which;
+	spin_unlock(&trigger_lock);
+
+	trigger_status_set(TRIGGER_RUNNING, 0);
+	rc = trigger_run(which);
+	pr_err("s5divert: Trigger %s failed: %pe\n", trigger_names[which], ERR_PTR(rc));
+	trigger_status_set(TRIGGER_FAILED, rc);
+	status_error(trigger_names[which], rc);
+}
+
+/* Queues a trigger and returns right away; only one of them can be pending at a time */
+static int trigger_queue(u8 which)
+{
+	// Module parameters given at load time are set before there is a workqueue
+	if (!wq) return trigger_run(which);
+
+	spin_lock(&trigger_lock);
+	if (trigger_state == TRIGGER_QUEUED || trigger_state == TRIGGER_RUNNING || trigger_state == TRIGGER_CLOSED) {
+		spin_unlock(&trigger_lock);
+		return -EBUSY;
+	}
+	trigger_state = TRIGGER_QUEUED;
+	trigger_which = which;
+	trigger_rc = 0;
+	queue_work(wq, &wq_work);
+	spin_unlock(&trigger_lock);
+
+	if (sysfs_dir_s5divert) sysfs_notify(sysfs_dir_s5divert, NULL, "trigger_status");
+	status_changed();
+	return 0;
+}
+
+static int trigger_status_format(char *buf, size_t size)
+{
+	u8 state, which;
+	int rc;
+
+	spin_lock(&trigger_lock);
+	state = trigger_state;
+	which = trigger_which;
+	rc = trigger_rc;
+	spin_unlock(&trigger_lock);
+
+	if (state == TRIGGER_IDLE || state == TRIGGER_CLOSED) return scnprintf(buf, size, "%s\n", trigger_states[state]);
+	if (state == TRIGGER_FAILED) return scnprintf(buf, size, "%s %s %pe\n", trigger_states[state], trigger_names[which], ERR_PTR(rc));
+	return scnprintf(buf, size, "%s %s\n", trigger_states[state], trigger_names[which]);
+}
+
+static int trigger_status_show(char *buf)
+{
+	return trigger_status_format(buf, PAGE_SIZE);
+}
+
+/* Takes the snapshot the one diversion runs with; false if it has been taken already */
+static bool divert_begin(void)
+{
+	u8 configured;
+
+	if (atomic_xchg(&diverting, 1)) return false;
+
+	config_get(&divert_cfg);
+	configured = divert_mode_resolve(&divert_cfg);
+	// Woken up by the S3S4 alarm: on to S4, whatever else is configured
+	if (s3s4_expired) configured = 1;
+	divert_mode = quirk_map_mode(configured);
 
-	return rc;
+	if (divert_mode != configured)
+		pr_info("s5divert: Quirks turn diversion to %s into %s\n", mode_names[configured], mode_names[divert_mode]);
+
+	if(divert_mode>0) timeline_begin(divert_mode);
+	return true;
 }
 
-static void system_poweroff(void)
+static bool s3s4_armed = false;
+
+/*
+ * Called before device_shutdown() on power off, so the snapshot is taken
+ * and the S3S4 alarm is set while devices are still up.
+ */
+static int divert_reboot_cb(struct notifier_block *nb, unsigned long action, void *data)
 {
-    kernel_power_off();
-    kernel_halt();
+	struct sys_off_handler *h = READ_ONCE(sysoff_hook_h);
+	int ret;
+
+	if (action != SYS_POWER_OFF || h==NULL || IS_ERR(h)) return NOTIFY_DONE;
+	if (!divert_begin()) return NOTIFY_DONE;
+	divert_early = true;
+
+	if (divert_mode == 5) {
+		if ((ret = s3s4_alarm_arm(divert_cfg.s3s4_hours))) {
+			pr_warn("s5divert: Unable to set the S3S4 alarm (%pe), diverting to S4 instead\n", ERR_PTR(ret));
+			status_error("s3s4", ret);
+			divert_mode = 1;
+		} else {
+			s3s4_armed = true;
+		}
+	}
+
+	// Devices are still up, so are the lid and the LEDs
+	if (mode_is_sleep(divert_mode)) lid_wait(&divert_cfg);
+	else lid_state = -1;	// Sleep states may still come up as fallbacks
+	return NOTIFY_DONE;
 }
 
-static void system_sync_poweroff(void)
+static struct notifier_block divert_reboot_nb = {
+	.notifier_call = divert_reboot_cb,
+};
+
+/* Jiffies left until the deadline, at least one; 0 without a deadline */
+static unsigned long divert_timeout(const struct s5divert_config *cfg, ktime_t deadline)
 {
-	// Call fs_sync, iff sysoff_hook_cb is not installed.
-	// If so then it will be called later anyway.
-	if (sysoff_hook_h==NULL || IS_ERR(sysoff_hook_h)) fs_sync();
-	system_poweroff();
+	s64 ms;
+
+	if (!cfg->deadline_ms) return 0;
+	ms = ktime_ms_delta(deadline, ktime_get());
+	return ms > 0 ? msecs_to_jiffies(ms) : 1;
 }
 
-static void system_reboot(bool hard)
+static bool divert_expired(const struct s5divert_config *cfg, ktime_t deadline)
 {
-    if (hard)	emergency_restart();
-    else 		kernel_restart(NULL);
+	return cfg->deadline_ms && ktime_after(ktime_get(), deadline);
 }
 
-//static void wq_worker(struct work_struct *work) {
-	// msleep(300);
-	// queue_work(wq, &wq_work);
-//}
+/*
+ * kernel_restart() runs device_shutdown() and the reboot notifiers once
+ * more, and any of them may wait for the interpreter that stuck AML
+ * holds. Reset the platform right away then.
+ */
+static u8 divert_reset_method(const struct s5divert_config *cfg)
+{
+	if (prep_state != PREP_HUNG || cfg->reset_method != RESET_RESTART) return cfg->reset_method;
+	pr_warn("s5divert: AML is stuck, resetting through ACPI instead of restarting\n");
+	return RESET_ACPI;
+}
 
-static int sysoff_hook_cb(struct sys_off_data *data)
+/* One step of the diversion; returns only if it failed */
+static int divert_step(const struct s5divert_config *cfg, u8 mode, unsigned long timeout)
 {
-	if(param_s5divert_enabled>0) fs_sync();
+	int ret;
 
-	switch (param_s5divert_enabled) {
+	switch (mode) {
 		case 1:
 		pr_warn("s5divert: Diverting ACPI S5 to S4\n");
-		param_s5divert_enabled = 0;
-		(void)enter_s4_noimage();
-		break;
+		return enter_s4_noimage(cfg, timeout);
 
 		case 2:
 		pr_warn("s5divert: Diverting ACPI S5 to S3\n");
-		param_s5divert_enabled = 0;
-		(void)enter_s3_noreturn();
-		break;
+		return enter_s3_noreturn(cfg, timeout);
+
+		case 5:
+		pr_warn("s5divert: Diverting ACPI S5 to S3, then S4 after %u hours\n", cfg->s3s4_hours);
+		// Set by the reboot notifier unless S3S4 is a fallback
+		if (!s3s4_armed) {
+			if ((ret = s3s4_alarm_arm(cfg->s3s4_hours))) {
+				pr_err("s5divert: Unable to set the S3S4 alarm: %pe\n", ERR_PTR(ret));
+				status_error("s3s4", ret);
+				return ret;
+			}
+			s3s4_armed = true;
+		}
+		// rtc-cmos keeps the alarm on power off, but the RTC event still has to wake from S3
+		acpi_clear_event(ACPI_EVENT_RTC);
+		acpi_enable_event(ACPI_EVENT_RTC, 0);
+		return enter_s3_noreturn(cfg, timeout);
 
 		case 3:
 		pr_warn("s5divert: Diverting ACPI S5 to system reboot\n");
-		param_s5divert_enabled = 0;
-		msleep(300);
+		settle("reboot", cfg->reboot_delay_ms);
+		system_reset(divert_reset_method(cfg));
 		system_reboot(false);
 		system_reboot(true);
-		break;
+		return -EIO;
+
+		case 4:
+		return system_kexec();
 
 		default:
-		break;
+		return 0;
+	}
+}
+
+/*
+ * Tries the configured mode, then each fallback in turn. The deadline is
+ * enforced by bounding the wait for the sync and for each preparation of a
+ * sleep state; once it has passed, or AML is stuck, only steps that do
+ * without the interpreter are left: reboot and S5.
+ */
+static int sysoff_hook_cb(struct sys_off_data *data)
+{
+	const struct s5divert_config *cfg = &divert_cfg;
+	u8 steps[1 + FALLBACK_LEN];
+	unsigned int i, nsteps = 0;
+	ktime_t deadline;
+
+	if (!divert_early && !divert_begin()) return NOTIFY_DONE;
+	if (divert_mode == 0) return NOTIFY_DONE;
+	deadline = ktime_add_ms(ktime_get(), cfg->deadline_ms);
+
+	fs_sync_bounded(cfg, divert_timeout(cfg, deadline));
+
+	steps[nsteps++] = divert_mode;
+	for (i = 0; i < cfg->fallback.count; i++) steps[nsteps++] = quirk_map_mode(cfg->fallback.modes[i]);
+
+	for (i = 0; i < nsteps; i++) {
+		u8 mode = steps[i];
+		int rc;
+
+		if (i) pr_warn("s5divert: Falling back to %s\n", mode ? mode_names[mode] : "S5");
+		timeline_attempt_begin(mode);
+		if (mode == 0) break;
+		if (mode_is_sleep(mode) && (prep_state == PREP_HUNG || divert_expired(cfg, deadline))) {
+			pr_err("s5divert: Out of time, skipping %s\n", mode_names[mode]);
+			timeline_attempt_end(-ETIMEDOUT);
+			continue;
+		}
+		rc = divert_step(cfg, mode, divert_timeout(cfg, deadline));
+		timeline_attempt_end(rc);
 	}
+	// Either way on to ACPI S5, which acpi_power_off() enters with the sleep type prepared last
+	if (READ_ONCE(sleep_prepped)) {
+		if (prep_state == PREP_HUNG) {
+			// S5 cannot be prepared again without the interpreter, and powering off would enter S4/S3
+			pr_err("s5divert: AML is stuck after preparing ACPI S%u, resetting instead of powering off\n", sleep_prepped);
+			system_reset(RESET_ACPI);
+		} else if (ACPI_FAILURE(acpi_enter_sleep_state_prep(ACPI_STATE_S5))) {
+			pr_err("s5divert: Unable to prepare ACPI S5 again\n");
+		} else {
+			WRITE_ONCE(sleep_prepped, 0);
+		}
+	}
+	// Keep record of what has been tried
+	timeline_store();
 	return NOTIFY_DONE;
 }
 
+/*
+ * The handler stays registered as long as any diversion is configured;
+ * which one is looked up by the callback itself. Callers hold config_lock.
+ */
 static int sysoff_hook_register(void)
 {
-	if (sysoff_hook_h!=NULL && !IS_ERR(sysoff_hook_h)) return 0;
-	switch (param_s5divert_enabled) {
-		case 1:
-		pr_info("s5divert: ACPI S5 will be diverted to S4\n");
-		// Run handler after all preparations have been made, but before the system actually starts powering down.
-		sysoff_hook_h = register_sys_off_handler(SYS_OFF_MODE_POWER_OFF_PREPARE, SYS_OFF_PRIO_PLATFORM - 1, sysoff_hook_cb, NULL);
-		break;
+	struct sys_off_handler *h;
 
-		case 2:
-		pr_info("s5divert: ACPI S5 will be diverted to S3\n");
-		// Run handler after all preparations have been made, but before the system actually starts powering down.
-		sysoff_hook_h = register_sys_off_handler(SYS_OFF_MODE_POWER_OFF_PREPARE, SYS_OFF_PRIO_PLATFORM - 1, sysoff_hook_cb, NULL);
-		break;
+	if (sysoff_hook_h!=NULL && !IS_ERR(sysoff_hook_h)) return 0;
 
-		case 3:
-		pr_info("s5divert: ACPI S5 will be diverted to system reboot\n");
-		// Run handler after all preparations have been made, but before the system actually starts powering down.
-		sysoff_hook_h = register_sys_off_handler(SYS_OFF_MODE_POWER_OFF_PREPARE, SYS_OFF_PRIO_PLATFORM - 1, sysoff_hook_cb, NULL);
-		break;
+	// Run handler after all preparations have been made, but before the system actually starts powering down.
+	h = register_sys_off_handler(SYS_OFF_MODE_POWER_OFF_PREPARE, SYS_OFF_PRIO_PLATFORM - 1, sysoff_hook_cb, NULL);
+	WRITE_ONCE(sysoff_hook_h, h);
 
-		default:
-		sysoff_hook_h = NULL;
-		break;
-	}
-	if (IS_ERR(sysoff_hook_h)) {
+	if (IS_ERR(h)) {
 		pr_err("s5divert: ACPI S5 diversion failed to register\n");
-		return PTR_ERR(sysoff_hook_h);
+		return PTR_ERR(h);
 	}
 	pr_info("s5divert: ACPI S5 diversion enabled\n");
 	return 0;
@@ -327,33 +2910,31 @@ static int sysoff_hook_unregister(void)
 		unregister_sys_off_handler(sysoff_hook_h);
 		pr_info("s5divert: ACPI S5 diversion disabled\n");
 	}
-	sysoff_hook_h = NULL;
+	WRITE_ONCE(sysoff_hook_h, NULL);
 	return 0;
 }
 
-static bool sysoff_hook_already_applied(void)
+static void sysoff_hook_apply(const struct s5divert_config *old, const struct s5divert_config *c)
 {
-	if (param_s5divert_enabled==0) {
-		if (sysoff_hook_h==NULL || !IS_ERR(sysoff_hook_h)) return true;
-	} else {
-		if (sysoff_hook_h!=NULL && !IS_ERR(sysoff_hook_h)) return true;
-	}
-	return false;
-}
+	lockdep_assert_held(&config_lock);
 
-static int sysoff_hook_apply(void)
-{
-	sysoff_hook_unregister();
-	if (param_s5divert_enabled != 0) sysoff_hook_register();
-	return 0;
+	if (!divert_configured(c)) {
+		sysoff_hook_unregister();
+		return;
+	}
+	if (!old || old->mode != c->mode || memcmp(&old->policy, &c->policy, sizeof(c->policy))) {
+		if (c->policy.active) pr_info("s5divert: ACPI S5 will be diverted depending on the power source\n");
+		else pr_info("s5divert: ACPI S5 will be diverted to %s\n", mode_descs[c->mode]);
+	}
+	sysoff_hook_register();
 }
 
 static ssize_t proc_s5divert_enabled_read(struct file *file, char __user *ubuf, size_t count, loff_t *ppos)
 {
-	char kbuf[8];
+	char kbuf[64];
 	int len;
 
-	len = scnprintf(kbuf, sizeof(kbuf), "%u\n", param_s5divert_enabled);
+	len = enabled_show(kbuf, sizeof(kbuf));
 	if (*ppos >= len)return 0;
 	if (count > len - *ppos) count = len - *ppos;
 	if (copy_to_user(ubuf, kbuf + *ppos, count)) return -EFAULT;
@@ -364,20 +2945,20 @@ static ssize_t proc_s5divert_enabled_read(struct file *file, char __user *ubuf,
 
 static ssize_t proc_s5divert_enabled_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos)
 {
-	char kbuf[32];
+	char kbuf[64];
 	size_t n = min(count, sizeof(kbuf) - 1);
+	struct power_policy pp;
 	u8 val;
 	int ret;
 
 	if (copy_from_user(kbuf, ubuf, n)) return -EFAULT;
 	kbuf[n] = '\0';
 
-	ret = kstrtou8(kbuf, 0, &val);
+	ret = enabled_parse(kbuf, &val, &pp);
 	if (ret) return ret;
-	if (val>3) return -ERANGE;
 
-	param_s5divert_enabled=val;
-	sysoff_hook_apply();
+	ret = enabled_set(val, &pp);
+	if (ret) return ret;
 	return count;
 }
 
@@ -414,8 +2995,11 @@ static ssize_t proc_s5divert_poweroff_write(struct file *file, const char __user
 	ret = kstrtobool(kbuf, &val);
 	if (ret) return ret;
 
-	param_s5divert_poweroff=val?true:false;
-	if (val) system_sync_poweroff();
+	param_s5divert_poweroff = val?true:false;
+	if (val) {
+		ret = trigger_queue(TRIGGER_POWEROFF);
+		if (ret) return ret;
+	}
 	return count;
 }
 
@@ -453,7 +3037,10 @@ static ssize_t proc_s5divert_reboot_write(struct file *file, const char __user *
 	if (ret) return ret;
 
 	param_s5divert_reboot = val?true:false;
-	if (val) system_reboot(false);
+	if (val) {
+		ret = trigger_queue(TRIGGER_REBOOT);
+		if (ret) return ret;
+	}
 	return count;
 }
 
@@ -491,7 +3078,10 @@ static ssize_t proc_s5divert_stroff_write(struct file *file, const char __user *
 	if (ret) return ret;
 
 	param_s5divert_stroff = val?true:false;
-	if (val) enter_s3_reboot();
+	if (val) {
+		ret = trigger_queue(TRIGGER_STROFF);
+		if (ret) return ret;
+	}
 	return count;
 }
 
@@ -510,11 +3100,13 @@ static int procfs_register(void)
 		proc_file_s5divert_poweroff = proc_create("poweroff", 0220, proc_dir_s5divert, &proc_s5divert_poweroff_ops);
 		proc_file_s5divert_reboot = proc_create("reboot", 0220, proc_dir_s5divert, &proc_s5divert_reboot_ops);
 		proc_file_s5divert_stroff = proc_create("stroff", 0220, proc_dir_s5divert, &proc_s5divert_stroff_ops);
+		proc_file_s5divert_wakeup_devices = proc_create_seq("wakeup_devices", 0444, proc_dir_s5divert, &wake_devs_seq_ops);
 	} else {
 		proc_file_s5divert_enabled = NULL;
 		proc_file_s5divert_poweroff = NULL;
 		proc_file_s5divert_reboot = NULL;
 		proc_file_s5divert_stroff = NULL;
+		proc_file_s5divert_wakeup_devices = NULL;
 	}
 	return 0;
 }
@@ -526,6 +3118,7 @@ static int procfs_unregister(void)
 		if (proc_file_s5divert_poweroff) { remove_proc_entry("poweroff", proc_dir_s5divert); proc_file_s5divert_poweroff = NULL; }
 		if (proc_file_s5divert_reboot) { remove_proc_entry("reboot", proc_dir_s5divert); proc_file_s5divert_reboot = NULL; }
 		if (proc_file_s5divert_stroff) { remove_proc_entry("stroff", proc_dir_s5divert); proc_file_s5divert_stroff = NULL; }
+		if (proc_file_s5divert_wakeup_devices) { remove_proc_entry("wakeup_devices", proc_dir_s5divert); proc_file_s5divert_wakeup_devices = NULL; }
 		remove_proc_entry("s5divert", NULL); proc_dir_s5divert = 0;
 	}
 	return 0;
@@ -533,17 +3126,17 @@ static int procfs_unregister(void)
 
 static ssize_t sysfs_s5divert_enabled_read(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-	return sysfs_emit(buf, "%u\n", param_s5divert_enabled);
+	return enabled_show(buf, PAGE_SIZE);
 }
 
 static ssize_t sysfs_s5divert_enabled_write(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
 {
+	struct power_policy pp;
 	u8 v;
-	int ret = kstrtou8(buf, 0, &v);
+	int ret = enabled_parse(buf, &v, &pp);
+	if (ret) return ret;
+	ret = enabled_set(v, &pp);
 	if (ret) return ret;
-	if (v>3) return -ERANGE;
-	param_s5divert_enabled = v;
-	sysoff_hook_apply();
 	return count;
 }
 
@@ -560,7 +3153,10 @@ static ssize_t sysfs_s5divert_poweroff_write(struct kobject *kobj, struct kobj_a
 	int ret = kstrtobool(buf, &b);
 	if (ret) return ret;
 	param_s5divert_poweroff = b?true:false;
-	if (b) system_sync_poweroff();
+	if (b) {
+		ret = trigger_queue(TRIGGER_POWEROFF);
+		if (ret) return ret;
+	}
 	return count;
 }
 
@@ -577,7 +3173,10 @@ static ssize_t sysfs_s5divert_reboot_write(struct kobject *kobj, struct kobj_att
 	int ret = kstrtobool(buf, &b);
 	if (ret) return ret;
 	param_s5divert_reboot = b?true:false;
-	if (b) system_reboot(false);
+	if (b) {
+		ret = trigger_queue(TRIGGER_REBOOT);
+		if (ret) return ret;
+	}
 	return count;
 }
 
@@ -594,12 +3193,437 @@ static ssize_t sysfs_s5divert_stroff_write(struct kobject *kobj, struct kobj_att
 	int ret = kstrtobool(buf, &b);
 	if (ret) return ret;
 	param_s5divert_stroff = b?true:false;
-	if (b) enter_s3_reboot();
+	if (b) {
+		ret = trigger_queue(TRIGGER_STROFF);
+		if (ret) return ret;
+	}
 	return count;
 }
 
 static struct kobj_attribute sysfs_s5divert_stroff_attr = __ATTR(stroff, 0220, sysfs_s5divert_stroff_read, sysfs_s5divert_stroff_write);
 
+static ssize_t sysfs_s5divert_trigger_status_read(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return trigger_status_show(buf);
+}
+
+static struct kobj_attribute sysfs_s5divert_trigger_status_attr = __ATTR(trigger_status, 0444, sysfs_s5divert_trigger_status_read, NULL);
+
+static ssize_t sysfs_s5divert_last_shutdown_read(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return last_shutdown_show(buf);
+}
+
+static struct kobj_attribute sysfs_s5divert_last_shutdown_attr = __ATTR(last_shutdown, 0444, sysfs_s5divert_last_shutdown_read, NULL);
+
+static ssize_t sysfs_s5divert_wakeup_dry_run_write(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	bool b;
+	int ret = kstrtobool(buf, &b);
+	if (ret) return ret;
+	if (b) wake_devs_dry_run();
+	return count;
+}
+
+static struct kobj_attribute sysfs_s5divert_wakeup_dry_run_attr = __ATTR(wakeup_dry_run, 0220, NULL, sysfs_s5divert_wakeup_dry_run_write);
+
+static ssize_t sysfs_s5divert_stroff_stats_read(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return stroff_stats_show(buf);
+}
+
+static struct kobj_attribute sysfs_s5divert_stroff_stats_attr = __ATTR(stroff_stats, 0444, sysfs_s5divert_stroff_stats_read, NULL);
+
+static ssize_t sysfs_s5divert_stroff_stats_reset_write(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	bool b;
+	int ret = kstrtobool(buf, &b);
+	if (ret) return ret;
+	if (b) stroff_stats_reset();
+	return count;
+}
+
+static struct kobj_attribute sysfs_s5divert_stroff_stats_reset_attr = __ATTR(stroff_stats_reset, 0220, NULL, sysfs_s5divert_stroff_stats_reset_write);
+
+static ssize_t sysfs_s5divert_wake_reason_read(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return wake_reason_show(buf);
+}
+
+static struct kobj_attribute sysfs_s5divert_wake_reason_attr = __ATTR(wake_reason, 0444, sysfs_s5divert_wake_reason_read, NULL);
+
+static ssize_t sysfs_s5divert_wake_reason_reset_write(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	bool b;
+	int ret = kstrtobool(buf, &b);
+	if (ret) return ret;
+	if (b) wake_reason_reset();
+	return count;
+}
+
+static struct kobj_attribute sysfs_s5divert_wake_reason_reset_attr = __ATTR(wake_reason_reset, 0220, NULL, sysfs_s5divert_wake_reason_reset_write);
+
+static ssize_t sysfs_s5divert_quirks_read(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return quirks_show(buf);
+}
+
+static ssize_t sysfs_s5divert_quirks_write(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	char *kbuf = kstrndup(buf, count, GFP_KERNEL);
+	int ret;
+
+	if (!kbuf) return -ENOMEM;
+	ret = quirks_add(kbuf);
+	kfree(kbuf);
+	return ret ? ret : count;
+}
+
+static struct kobj_attribute sysfs_s5divert_quirks_attr = __ATTR(quirks, 0664, sysfs_s5divert_quirks_read, sysfs_s5divert_quirks_write);
+
+/*
+ * Tunables backed by a field of struct s5divert_config. Each of them is
+ * exposed under /sys/kernel/s5divert and as a module parameter.
+ */
+struct config_attr {
+	struct kobj_attribute attr;
+	size_t offset;
+	int (*set)(struct s5divert_config *c, size_t offset, const char *val);
+	int (*show)(const struct s5divert_config *c, size_t offset, char *buf, size_t size);
+};
+
+#define CONFIG_FIELD(c, offset, type) ((type *)((char *)(c) + (offset)))
+
+static int config_set_uint(struct s5divert_config *c, size_t offset, const char *val)
+{
+	return kstrtouint(val, 0, CONFIG_FIELD(c, offset, unsigned int));
+}
+
+static int config_show_uint(const struct s5divert_config *c, size_t offset, char *buf, size_t size)
+{
+	return scnprintf(buf, size, "%u\n", *CONFIG_FIELD(c, offset, const unsigned int));
+}
+
+static int config_set_bool(struct s5divert_config *c, size_t offset, const char *val)
+{
+	return kstrtobool(val, CONFIG_FIELD(c, offset, bool));
+}
+
+static int config_show_bool(const struct s5divert_config *c, size_t offset, char *buf, size_t size)
+{
+	return scnprintf(buf, size, "%d\n", *CONFIG_FIELD(c, offset, const bool) ? 1 : 0);
+}
+
+static int config_set_sync(struct s5divert_config *c, size_t offset, const char *val)
+{
+	int ret = sysfs_match_string(sync_modes, val);
+	if (ret < 0) return ret;
+	*CONFIG_FIELD(c, offset, u8) = ret;
+	return 0;
+}
+
+static int config_show_sync(const struct s5divert_config *c, size_t offset, char *buf, size_t size)
+{
+	return scnprintf(buf, size, "%s\n", sync_modes[*CONFIG_FIELD(c, offset, const u8)]);
+}
+
+static int config_set_reset(struct s5divert_config *c, size_t offset, const char *val)
+{
+	int ret = sysfs_match_string(reset_methods, val);
+	if (ret < 0) return ret;
+	*CONFIG_FIELD(c, offset, u8) = ret;
+	return 0;
+}
+
+static int config_show_reset(const struct s5divert_config *c, size_t offset, char *buf, size_t size)
+{
+	return scnprintf(buf, size, "%s\n", reset_methods[*CONFIG_FIELD(c, offset, const u8)]);
+}
+
+static int config_set_fallback(struct s5divert_config *c, size_t offset, const char *val)
+{
+	struct fallback_list fl = { 0 };
+	char kbuf[64], *p, *tok;
+	int ret;
+
+	if (strscpy(kbuf, val, sizeof(kbuf)) < 0) return -E2BIG;
+	p = strim(kbuf);
+	if (!strcasecmp(p, "none")) *p = '\0';
+	while ((tok = strsep(&p, ",")) != NULL) {
+		if (!*tok) continue;
+		if (fl.count == FALLBACK_LEN) return -E2BIG;
+		ret = mode_parse(strim(tok), &fl.modes[fl.count++]);
+		if (ret) return ret;
+	}
+	*CONFIG_FIELD(c, offset, struct fallback_list) = fl;
+	return 0;
+}
+
+static int config_show_fallback(const struct s5divert_config *c, size_t offset, char *buf, size_t size)
+{
+	const struct fallback_list *fl = CONFIG_FIELD(c, offset, const struct fallback_list);
+	int i, len = 0;
+
+	if (!fl->count) return scnprintf(buf, size, "none\n");
+	for (i = 0; i < fl->count; i++)
+		len += scnprintf(buf + len, size - len, "%s%s", i ? "," : "", fl->modes[i] ? mode_names[fl->modes[i]] : "S5");
+	return len + scnprintf(buf + len, size - len, "\n");
+}
+
+static int config_set_wake_list(struct s5divert_config *c, size_t offset, const char *val)
+{
+	char kbuf[WAKE_LIST_LEN];
+
+	if (strscpy(kbuf, val, sizeof(kbuf)) < 0) return -E2BIG;
+	strscpy(CONFIG_FIELD(c, offset, char), strim(kbuf), WAKE_LIST_LEN);
+	return 0;
+}
+
+static int config_show_wake_list(const struct s5divert_config *c, size_t offset, char *buf, size_t size)
+{
+	return scnprintf(buf, size, "%s\n", CONFIG_FIELD(c, offset, const char));
+}
+
+static int config_attr_store(const struct config_attr *ca, const char *val)
+{
+	struct s5divert_config *c = config_begin();
+	int ret;
+
+	if (!c) return -ENOMEM;
+	ret = ca->set(c, ca->offset, val);
+	if (ret) {
+		config_abort(c);
+		return ret;
+	}
+	config_commit(c);
+	return 0;
+}
+
+static int config_attr_show(const struct config_attr *ca, char *buf)
+{
+	int len;
+
+	rcu_read_lock();
+	len = ca->show(rcu_dereference(config), ca->offset, buf, PAGE_SIZE);
+	rcu_read_unlock();
+	return len;
+}
+
+static ssize_t sysfs_s5divert_config_read(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return config_attr_show(container_of(attr, struct config_attr, attr), buf);
+}
+
+static ssize_t sysfs_s5divert_config_write(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int ret = config_attr_store(container_of(attr, struct config_attr, attr), buf);
+	return ret ? ret : count;
+}
+
+#define CONFIG_ATTR(_name, _type) \
+	static struct config_attr sysfs_s5divert_##_name##_attr = { \
+		.attr = __ATTR(_name, 0664, sysfs_s5divert_config_read, sysfs_s5divert_config_write), \
+		.offset = offsetof(struct s5divert_config, _name), \
+		.set = config_set_##_type, \
+		.show = config_show_##_type, \
+	}
+
+CONFIG_ATTR(dsw_delay_ms, uint);
+CONFIG_ATTR(prep_delay_ms, uint);
+CONFIG_ATTR(sync_delay_ms, uint);
+CONFIG_ATTR(reboot_delay_ms, uint);
+CONFIG_ATTR(stroff_delay_ms, uint);
+CONFIG_ATTR(stroff_fast, bool);
+CONFIG_ATTR(efi_records, bool);
+CONFIG_ATTR(s3s4_hours, uint);
+CONFIG_ATTR(lid_wait_ms, uint);
+CONFIG_ATTR(deadline_ms, uint);
+CONFIG_ATTR(fallback, fallback);
+CONFIG_ATTR(wake_parallel, bool);
+CONFIG_ATTR(sync, sync);
+CONFIG_ATTR(reset_method, reset);
+CONFIG_ATTR(wake_allow, wake_list);
+CONFIG_ATTR(wake_deny, wake_list);
+
+static int config_set_mode(struct s5divert_config *c, size_t offset, const char *val)
+{
+	struct power_policy pp;
+	u8 mode;
+	int ret = enabled_parse(val, &mode, &pp);
+
+	if (ret) return ret;
+	c->policy = pp;
+	c->mode = pp.active ? 0 : mode;
+	return 0;
+}
+
+static int config_show_mode(const struct s5divert_config *c, size_t offset, char *buf, size_t size)
+{
+	const struct power_policy *pp = &c->policy;
+
+	if (!pp->active) return scnprintf(buf, size, "%s\n", mode_names[c->mode]);
+	return scnprintf(buf, size, "ac=%s,battery=%s,low=%s,below=%u\n",
+		mode_names[pp->ac], mode_names[pp->battery], mode_names[pp->low], pp->below);
+}
+
+static int config_set_delays(struct s5divert_config *c, size_t offset, const char *val)
+{
+	unsigned int ms;
+	int ret = kstrtouint(val, 0, &ms);
+
+	if (ret) return ret;
+	c->dsw_delay_ms = c->prep_delay_ms = c->sync_delay_ms = c->reboot_delay_ms = c->stroff_delay_ms = ms;
+	return 0;
+}
+
+/* Keys only known to the config batch; those without show are write-only shorthands */
+#define CONFIG_KEY(_name, _field, _set, _show) \
+	static struct config_attr config_key_##_name = { \
+		.attr = { .attr = { .name = #_name } }, \
+		.offset = offsetof(struct s5divert_config, _field), \
+		.set = _set, \
+		.show = _show, \
+	}
+
+CONFIG_KEY(mode, mode, config_set_mode, config_show_mode);
+CONFIG_KEY(enabled, mode, config_set_mode, NULL);
+CONFIG_KEY(wake, wake_allow, config_set_wake_list, NULL);
+CONFIG_KEY(delay_ms, dsw_delay_ms, config_set_delays, NULL);
+
+static const struct config_attr * const config_keys[] = {
+	&config_key_mode,
+	&sysfs_s5divert_sync_attr,
+	&sysfs_s5divert_reset_method_attr,
+	&sysfs_s5divert_wake_parallel_attr,
+	&sysfs_s5divert_wake_allow_attr,
+	&sysfs_s5divert_wake_deny_attr,
+	&sysfs_s5divert_dsw_delay_ms_attr,
+	&sysfs_s5divert_prep_delay_ms_attr,
+	&sysfs_s5divert_sync_delay_ms_attr,
+	&sysfs_s5divert_reboot_delay_ms_attr,
+	&sysfs_s5divert_stroff_delay_ms_attr,
+	&sysfs_s5divert_stroff_fast_attr,
+	&sysfs_s5divert_efi_records_attr,
+	&sysfs_s5divert_s3s4_hours_attr,
+	&sysfs_s5divert_lid_wait_ms_attr,
+	&sysfs_s5divert_deadline_ms_attr,
+	&sysfs_s5divert_fallback_attr,
+	&config_key_enabled,
+	&config_key_wake,
+	&config_key_delay_ms,
+};
+
+static int config_batch_kv(const char *key, char *val, void *ctx)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(config_keys); i++) {
+		if (!strcmp(key, config_keys[i]->attr.attr.name))
+			return config_keys[i]->set(ctx, config_keys[i]->offset, val);
+	}
+	pr_err("s5divert: Unknown config key '%s'\n", key);
+	return -EINVAL;
+}
+
+/* Applies all key=value pairs at once, or none of them if any is invalid */
+static int config_batch_store(const char *buf, size_t count)
+{
+	struct s5divert_config *c;
+	char *kbuf = kstrndup(buf, count, GFP_KERNEL);
+	int ret;
+
+	if (!kbuf) return -ENOMEM;
+	c = config_begin();
+	if (!c) {
+		kfree(kbuf);
+		return -ENOMEM;
+	}
+	ret = kv_parse(kbuf, config_batch_kv, c);
+	kfree(kbuf);
+	if (ret) {
+		config_abort(c);
+		return ret;
+	}
+	config_commit(c);
+	return 0;
+}
+
+/* One line of key=value pairs that can be written back as it is */
+static int config_batch_show(char *buf)
+{
+	const struct s5divert_config *c;
+	int i, n, len = 0;
+
+	rcu_read_lock();
+	c = rcu_dereference(config);
+	for (i = 0; i < ARRAY_SIZE(config_keys); i++) {
+		if (!config_keys[i]->show) continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s=", config_keys[i]->attr.attr.name);
+		n = config_keys[i]->show(c, config_keys[i]->offset, buf + len, PAGE_SIZE - len);
+		len += n;
+		if (n && buf[len - 1] == '\n') buf[len - 1] = ' ';
+	}
+	rcu_read_unlock();
+	if (len) buf[len - 1] = '\n';
+	return len;
+}
+
+static ssize_t sysfs_s5divert_config_batch_read(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return config_batch_show(buf);
+}
+
+static ssize_t sysfs_s5divert_config_batch_write(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int ret = config_batch_store(buf, count);
+	return ret ? ret : count;
+}
+
+static struct kobj_attribute sysfs_s5divert_config_batch_attr = __ATTR(config, 0664, sysfs_s5divert_config_batch_read, sysfs_s5divert_config_batch_write);
+
+/* Everything a monitoring agent wants to know, one key=value per line */
+static int status_show(char *buf)
+{
+	struct sys_off_handler *h = READ_ONCE(sysoff_hook_h);
+	const char *what;
+	unsigned int devs;
+	int len = 0, rc;
+
+	len += sysfs_emit_at(buf, len, "mode=");
+	rcu_read_lock();
+	len += config_show_mode(rcu_dereference(config), 0, buf + len, PAGE_SIZE - len);
+	rcu_read_unlock();
+	len += sysfs_emit_at(buf, len, "handler=%d\n", h != NULL && !IS_ERR(h));
+	len += sysfs_emit_at(buf, len, "diverting=%d\n", atomic_read(&diverting));
+
+	mutex_lock(&wake_devs_lock);
+	devs = wake_devs_count;
+	mutex_unlock(&wake_devs_lock);
+	len += sysfs_emit_at(buf, len, "wake_devs=%u\n", devs);
+
+	mutex_lock(&quirks_lock);
+	len += sysfs_emit_at(buf, len, "quirk=%s\n", quirk_matched ? quirk_active.ident : "none");
+	mutex_unlock(&quirks_lock);
+
+	len += sysfs_emit_at(buf, len, "trigger=");
+	len += trigger_status_format(buf + len, PAGE_SIZE - len);
+
+	spin_lock(&status_lock);
+	what = status_error_what;
+	rc = status_error_rc;
+	spin_unlock(&status_lock);
+	if (what) len += sysfs_emit_at(buf, len, "last_error=%s %pe\n", what, ERR_PTR(rc));
+	else len += sysfs_emit_at(buf, len, "last_error=none\n");
+	return len;
+}
+
+static ssize_t sysfs_s5divert_status_read(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return status_show(buf);
+}
+
+static struct kobj_attribute sysfs_s5divert_status_attr = __ATTR(status, 0444, sysfs_s5divert_status_read, NULL);
+
 static int sysfs_register(void)
 {
 	int ret;
@@ -609,6 +3633,32 @@ static int sysfs_register(void)
 		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_poweroff_attr.attr);
 		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_reboot_attr.attr);
 		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_stroff_attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_trigger_status_attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_dsw_delay_ms_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_prep_delay_ms_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_sync_delay_ms_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_reboot_delay_ms_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_stroff_delay_ms_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_stroff_fast_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_efi_records_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_s3s4_hours_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_lid_wait_ms_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_deadline_ms_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_fallback_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_wake_parallel_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_sync_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_reset_method_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_quirks_attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_wake_allow_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_wake_deny_attr.attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_config_batch_attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_last_shutdown_attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_stroff_stats_attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_stroff_stats_reset_attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_status_attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_wakeup_dry_run_attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_wake_reason_attr.attr);
+		ret = sysfs_create_file(sysfs_dir_s5divert, &sysfs_s5divert_wake_reason_reset_attr.attr);
 	}
 	return 0;
 }
@@ -616,6 +3666,32 @@ static int sysfs_register(void)
 static int sysfs_unregister(void)
 {
 	if (sysfs_dir_s5divert) {
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_wake_reason_reset_attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_wake_reason_attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_wakeup_dry_run_attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_status_attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_stroff_stats_reset_attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_stroff_stats_attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_last_shutdown_attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_config_batch_attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_wake_deny_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_wake_allow_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_quirks_attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_reset_method_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_sync_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_wake_parallel_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_fallback_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_deadline_ms_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_lid_wait_ms_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_s3s4_hours_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_efi_records_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_stroff_fast_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_stroff_delay_ms_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_reboot_delay_ms_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_sync_delay_ms_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_prep_delay_ms_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_dsw_delay_ms_attr.attr.attr);
+			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_trigger_status_attr.attr);
 			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_stroff_attr.attr);
 			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_reboot_attr.attr);
 			sysfs_remove_file(sysfs_dir_s5divert, &sysfs_s5divert_poweroff_attr.attr);
@@ -628,20 +3704,16 @@ static int sysfs_unregister(void)
 
 static int param_s5divert_enabled_set(const char *val, const struct kernel_param *kp)
 {
+	struct power_policy pp;
 	u8 v;
-	int ret = kstrtou8(val, 0, &v);
+	int ret = enabled_parse(val, &v, &pp);
 	if (ret) return ret;
-	if (v>3) return -ERANGE;
-	param_s5divert_enabled = v;
-	*(u8 *)kp->arg = v;
-	if(param_s5divert_enabled == 2) enter_s3_reboot();
-	sysoff_hook_apply();
-	return 0;
+	return enabled_set(v, &pp);
 }
 
 static int param_s5divert_enabled_get(char *buf, const struct kernel_param *kp)
 {
-	return sysfs_emit(buf, "%u\n", param_s5divert_enabled);
+	return enabled_show(buf, PAGE_SIZE);
 }
 
 static const struct kernel_param_ops param_s5divert_enabled_ops = {
@@ -655,7 +3727,7 @@ static int param_s5divert_poweroff_set(const char *val, const struct kernel_para
 	int ret = kstrtobool(val, &b);
 	if (ret) return ret;
 	*(bool *)kp->arg = b;
-	if (b) system_sync_poweroff();
+	if (b) return trigger_queue(TRIGGER_POWEROFF);
 	return 0;
 }
 
@@ -675,7 +3747,7 @@ static int param_s5divert_reboot_set(const char *val, const struct kernel_param
 	int ret = kstrtobool(val, &b);
 	if (ret) return ret;
 	*(bool *)kp->arg = b;
-	if (b) system_reboot(false);
+	if (b) return trigger_queue(TRIGGER_REBOOT);
 	return 0;
 }
 
@@ -695,7 +3767,7 @@ static int param_s5divert_stroff_set(const char *val, const struct kernel_param
 	int ret = kstrtobool(val, &b);
 	if (ret) return ret;
 	*(bool *)kp->arg = b;
-	if (b) enter_s3_reboot();
+	if (b) return trigger_queue(TRIGGER_STROFF);
 	return 0;
 }
 
@@ -709,26 +3781,105 @@ static const struct kernel_param_ops param_s5divert_stroff_ops = {
 	.get = param_s5divert_stroff_get,
 };
 
+static int param_s5divert_config_set(const char *val, const struct kernel_param *kp)
+{
+	return config_attr_store(kp->arg, val);
+}
+
+static int param_s5divert_config_get(char *buf, const struct kernel_param *kp)
+{
+	return config_attr_show(kp->arg, buf);
+}
+
+static const struct kernel_param_ops param_s5divert_config_ops = {
+	.set = param_s5divert_config_set,
+	.get = param_s5divert_config_get,
+};
+
 static int __init s5divert_init(void)
 {
-	//wq = alloc_workqueue("s5divert_wq", WQ_UNBOUND | WQ_HIGHPRI | WQ_FREEZABLE, 1);
-	//if (!wq) return -ENOMEM;
-	//INIT_WORK(&wq_work, wq_worker);
+	int ret;
+
+	// Not freezable: stroff suspends the system from within its work item
+	wq = alloc_workqueue("s5divert_wq", WQ_UNBOUND | WQ_HIGHPRI, 1);
+	if (!wq) {
+		ret = -ENOMEM;
+		goto err_params;
+	}
+
+	mutex_lock(&quirks_lock);
+	quirks_resolve();
+	mutex_unlock(&quirks_lock);
+
+	wake_devs_refresh();
+	wake_reason_capture();
+	led_trigger_register_simple("s5divert-lid", &lid_led_trigger);
+	if ((ret = acpi_reconfig_notifier_register(&wake_devs_reconfig_nb))) goto err_led;
+	if ((ret = bus_register_notifier(&pci_bus_type, &wake_devs_pci_nb))) goto err_reconfig;
+	if ((ret = bus_register_notifier(&platform_bus_type, &wake_devs_platform_nb))) goto err_pci;
+	if ((ret = register_reboot_notifier(&divert_reboot_nb))) goto err_platform;
+	last_shutdown_load();
+	wake_reason_account();
+	stroff_stats_load();
+	register_syscore_ops(&stroff_syscore_ops);
 
 	procfs_register();
 	sysfs_register();
-	if (!sysoff_hook_already_applied()) sysoff_hook_apply();
+	mutex_lock(&config_lock);
+	sysoff_hook_apply(NULL, rcu_dereference_protected(config, lockdep_is_held(&config_lock)));
+	mutex_unlock(&config_lock);
+	s3s4_check();
 	pr_info("s5divert: loaded (kernel %s)\n", UTS_RELEASE);
 	return 0;
+
+err_platform:
+	bus_unregister_notifier(&platform_bus_type, &wake_devs_platform_nb);
+err_pci:
+	bus_unregister_notifier(&pci_bus_type, &wake_devs_pci_nb);
+err_reconfig:
+	acpi_reconfig_notifier_unregister(&wake_devs_reconfig_nb);
+	cancel_work_sync(&wake_devs_refresh_work);
+err_led:
+	led_trigger_unregister_simple(lid_led_trigger);
+	wake_devs_free();
+	quirks_free();
+	destroy_workqueue(wq); wq = NULL;
+err_params:
+	// Parameters given at load time may have replaced the config and registered the sys-off handler
+	mutex_lock(&config_lock);
+	sysoff_hook_unregister();
+	mutex_unlock(&config_lock);
+	if (rcu_access_pointer(config) != &config_initial) kfree(rcu_dereference_protected(config, 1));
+	pr_err("s5divert: Failed to load: %pe\n", ERR_PTR(ret));
+	return ret;
 }
 
 static void __exit s5divert_exit(void)
 {
-	//destroy_workqueue(wq); wq = NULL;
+	// No more triggers from here on, then wait for the one in flight, if any
+	trigger_status_set(TRIGGER_CLOSED, 0);
+	destroy_workqueue(wq); wq = NULL;
+	unregister_syscore_ops(&stroff_syscore_ops);
+	flush_work(&stroff_stats_store_work);
+	// A refresh would otherwise notify a directory that is gone
+	acpi_reconfig_notifier_unregister(&wake_devs_reconfig_nb);
+	bus_unregister_notifier(&platform_bus_type, &wake_devs_platform_nb);
+	bus_unregister_notifier(&pci_bus_type, &wake_devs_pci_nb);
+	cancel_work_sync(&wake_devs_refresh_work);
+	cancel_work_sync(&s3s4_poweroff_work);
+	unregister_reboot_notifier(&divert_reboot_nb);
 
 	sysfs_unregister();
 	procfs_unregister();
+	mutex_lock(&config_lock);
 	sysoff_hook_unregister();
+	mutex_unlock(&config_lock);
+
+	led_trigger_unregister_simple(lid_led_trigger);
+	wake_devs_free();
+	quirks_free();
+	// Every reader is gone along with the sys-off handler and the attributes
+	if (rcu_access_pointer(config) != &config_initial) kfree(rcu_dereference_protected(config, 1));
 	pr_info("s5divert: unloaded\n");
 }
 
@@ -736,20 +3887,61 @@ MODULE_VERSION("1.0.0");
 MODULE_DESCRIPTION("Divert system power off from ACPI S5 to S4, S3, or system reboot");
 MODULE_AUTHOR("rbm78bln");
 MODULE_LICENSE("GPL");
+#if IS_ENABLED(CONFIG_EFI) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("EFIVAR");
+#elif IS_ENABLED(CONFIG_EFI) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+MODULE_IMPORT_NS(EFIVAR);
+#endif
 
 MODULE_PARM_DESC(enabled, " Enable/disable diversion of ACPI S5 to either\n"
     		"                   0: diversion disabled\n"
 			"                   1: ACPI state S4 (without saving) [default]\n"
 			"                   2: ACPI state S3 (without return vector)\n"
-			"                   3: ACPI state S0 (reboot)");
+			"                   3: ACPI state S0 (reboot)\n"
+			"                   4: kexec into a preloaded kernel, run by userspace's shutdown\n"
+			"                      hook; powering off reaches the fallbacks instead\n"
+			"                   5: ACPI state S3, then S4 after s3s4_hours (S3S4)\n"
+			"                   or a policy by power source, e.g. ac=S3,battery=S4,low=reboot,below=10");
 MODULE_PARM_DESC(poweroff, " Instantly power off the system. Default: 0");
 MODULE_PARM_DESC(reboot, " Instantly reboot the system. Default: 0");
 MODULE_PARM_DESC(stroff, " Instantly enter ACPI state S3 and reboot the system right away after waking up. Default: 0");
-
-module_param_cb(enabled, &param_s5divert_enabled_ops, &param_s5divert_enabled, 0664);
+MODULE_PARM_DESC(dsw_delay_ms, " Delay before each _DSW call in ms. Default: 0");
+MODULE_PARM_DESC(prep_delay_ms, " Max. time in ms to wait for armed wakeup GPEs to go quiet before entering S4/S3. Default: 0");
+MODULE_PARM_DESC(sync_delay_ms, " Delay after syncing discs in ms. Default: 0");
+MODULE_PARM_DESC(reboot_delay_ms, " Delay before a diverted reboot in ms. Default: 0");
+MODULE_PARM_DESC(stroff_delay_ms, " Delay before entering S3 by the stroff trigger in ms. Default: 0");
+MODULE_PARM_DESC(stroff_fast, " Reset the platform right after waking up from stroff, without resuming devices. Default: 0");
+MODULE_PARM_DESC(efi_records, " Keep the timeline of the last shutdown, wake reasons and stroff statistics in EFI variables. Default: 0");
+MODULE_PARM_DESC(s3s4_hours, " Hours in S3 before waking up by RTC alarm and entering S4 with enabled=5. Default: 2");
+MODULE_PARM_DESC(lid_wait_ms, " Max. time in ms to wait for the lid to close before entering S4/S3, and only then arm it for wakeup. Default: 0");
+MODULE_PARM_DESC(deadline_ms, " Time budget in ms for the whole diversion before falling back, 0 for none. Default: 0");
+MODULE_PARM_DESC(fallback, " Modes to try in order if a diversion fails or runs out of time, e.g. S3,reboot,S5. Default: none");
+MODULE_PARM_DESC(wake_parallel, " Arm ACPI wakeup devices concurrently instead of one after another. Default: 0");
+MODULE_PARM_DESC(wake_allow, " ACPI wakeup devices (names or HIDs, comma separated) to arm regardless of /proc/acpi/wakeup");
+MODULE_PARM_DESC(wake_deny, " ACPI wakeup devices (names or HIDs, comma separated, * for all) not to arm regardless of /proc/acpi/wakeup");
+MODULE_PARM_DESC(sync, " Filesystems to sync before diverting: none, root, all [default]");
+MODULE_PARM_DESC(reset_method, " How diverted reboots reset the system: restart [default], acpi, efi, emergency");
+
+module_param_cb(enabled, &param_s5divert_enabled_ops, NULL, 0664);
 module_param_cb(poweroff, &param_s5divert_poweroff_ops, &param_s5divert_poweroff, 0220);
 module_param_cb(reboot, &param_s5divert_reboot_ops, &param_s5divert_reboot, 0220);
 module_param_cb(stroff, &param_s5divert_stroff_ops, &param_s5divert_stroff, 0220);
+module_param_cb(dsw_delay_ms, &param_s5divert_config_ops, &sysfs_s5divert_dsw_delay_ms_attr, 0664);
+module_param_cb(prep_delay_ms, &param_s5divert_config_ops, &sysfs_s5divert_prep_delay_ms_attr, 0664);
+module_param_cb(sync_delay_ms, &param_s5divert_config_ops, &sysfs_s5divert_sync_delay_ms_attr, 0664);
+module_param_cb(reboot_delay_ms, &param_s5divert_config_ops, &sysfs_s5divert_reboot_delay_ms_attr, 0664);
+module_param_cb(stroff_delay_ms, &param_s5divert_config_ops, &sysfs_s5divert_stroff_delay_ms_attr, 0664);
+module_param_cb(stroff_fast, &param_s5divert_config_ops, &sysfs_s5divert_stroff_fast_attr, 0664);
+module_param_cb(efi_records, &param_s5divert_config_ops, &sysfs_s5divert_efi_records_attr, 0664);
+module_param_cb(s3s4_hours, &param_s5divert_config_ops, &sysfs_s5divert_s3s4_hours_attr, 0664);
+module_param_cb(lid_wait_ms, &param_s5divert_config_ops, &sysfs_s5divert_lid_wait_ms_attr, 0664);
+module_param_cb(deadline_ms, &param_s5divert_config_ops, &sysfs_s5divert_deadline_ms_attr, 0664);
+module_param_cb(fallback, &param_s5divert_config_ops, &sysfs_s5divert_fallback_attr, 0664);
+module_param_cb(wake_parallel, &param_s5divert_config_ops, &sysfs_s5divert_wake_parallel_attr, 0664);
+module_param_cb(wake_allow, &param_s5divert_config_ops, &sysfs_s5divert_wake_allow_attr, 0664);
+module_param_cb(wake_deny, &param_s5divert_config_ops, &sysfs_s5divert_wake_deny_attr, 0664);
+module_param_cb(sync, &param_s5divert_config_ops, &sysfs_s5divert_sync_attr, 0664);
+module_param_cb(reset_method, &param_s5divert_config_ops, &sysfs_s5divert_reset_method_attr, 0664);
 
 module_init(s5divert_init);
 module_exit(s5divert_exit);
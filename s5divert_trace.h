@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints along the diversion path of s5divert.ko
+ *
+ *   echo 1 > /sys/kernel/tracing/events/s5divert/enable
+ *   trace-cmd record -e s5divert
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM s5divert
+
+#if !defined(_S5DIVERT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _S5DIVERT_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+#define s5divert_assign_str(dst, src) __assign_str(dst, src)
+#else
+#define s5divert_assign_str(dst, src) __assign_str(dst)
+#endif
+
+/*
+ * Each phase of a diversion, e.g. "fs_sync", "_TTS", "wake_arm",
+ * "sleep_prep", "sleep", "pm_suspend", "reboot" or "kexec". arg is the
+ * sleep state or mode a phase is entered with, rc what it returned.
+ */
+DECLARE_EVENT_CLASS(s5divert_phase,
+	TP_PROTO(const char *phase, int val),
+	TP_ARGS(phase, val),
+	TP_STRUCT__entry(
+		__string(phase, phase)
+		__field(int, val)
+	),
+	TP_fast_assign(
+		s5divert_assign_str(phase, phase);
+		__entry->val = val;
+	),
+	TP_printk("%s %d", __get_str(phase), __entry->val)
+);
+
+DEFINE_EVENT(s5divert_phase, s5divert_phase_enter,
+	TP_PROTO(const char *phase, int arg),
+	TP_ARGS(phase, arg)
+);
+
+DEFINE_EVENT(s5divert_phase, s5divert_phase_exit,
+	TP_PROTO(const char *phase, int rc),
+	TP_ARGS(phase, rc)
+);
+
+/* One wakeup device, after it has been armed or left alone */
+TRACE_EVENT(s5divert_wake_dev,
+	TP_PROTO(const char *name, const char *hid, u32 gpe, bool dsw, bool armed, int rc, s64 duration_us),
+	TP_ARGS(name, hid, gpe, dsw, armed, rc, duration_us),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__string(hid, hid)
+		__field(u32, gpe)
+		__field(bool, dsw)
+		__field(bool, armed)
+		__field(int, rc)
+		__field(s64, duration_us)
+	),
+	TP_fast_assign(
+		s5divert_assign_str(name, name);
+		s5divert_assign_str(hid, hid);
+		__entry->gpe = gpe;
+		__entry->dsw = dsw;
+		__entry->armed = armed;
+		__entry->rc = rc;
+		__entry->duration_us = duration_us;
+	),
+	TP_printk("%s (%s) gpe=0x%02x method=%s armed=%d rc=%d in %lld us",
+		__get_str(name), __get_str(hid), __entry->gpe, __entry->dsw ? "_DSW" : "_PSW",
+		__entry->armed, __entry->rc, __entry->duration_us)
+);
+
+#endif /* _S5DIVERT_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE s5divert_trace
+#include <trace/define_trace.h>
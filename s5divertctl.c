@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * s5divertctl - configure s5divert.ko with a single write
+ *
+ *   s5divertctl                              print the active configuration
+ *   s5divertctl key=value ...                apply all pairs at once
+ *   s5divertctl [key=value ...] <trigger>    apply, then pull poweroff, reboot or stroff
+ *
+ * All key=value pairs end up in one write(2) to /sys/kernel/s5divert/config,
+ * so the module takes either all of them or none.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SYSFS_DIR "/sys/kernel/s5divert/"
+
+static const char * const triggers[] = { "poweroff", "reboot", "stroff" };
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [key=value ...] [poweroff|reboot|stroff]\n"
+		"\n"
+		"Keys: mode, sync, reset_method, wake_parallel, wake_allow, wake_deny,\n"
+		"      s3s4_hours, lid_wait_ms, deadline_ms, fallback, stroff_fast, efi_records,\n"
+		"      dsw_delay_ms, prep_delay_ms, sync_delay_ms, reboot_delay_ms, stroff_delay_ms,\n"
+		"      wake (same as wake_allow), delay_ms (sets all delays)\n"
+		"\n"
+		"Without arguments the active configuration is printed.\n", prog);
+}
+
+static int write_file(const char *name, const char *buf, size_t len)
+{
+	char path[64];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), SYSFS_DIR "%s", name);
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "s5divertctl: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	n = write(fd, buf, len);
+	if (n < 0) fprintf(stderr, "s5divertctl: %s: %s\n", path, strerror(errno));
+	close(fd);
+	return n < 0 ? -1 : 0;
+}
+
+static int show_config(void)
+{
+	char buf[4096];
+	ssize_t n;
+	int fd = open(SYSFS_DIR "config", O_RDONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "s5divertctl: " SYSFS_DIR "config: %s\n", strerror(errno));
+		return 1;
+	}
+	while ((n = read(fd, buf, sizeof(buf))) > 0) fwrite(buf, 1, n, stdout);
+	close(fd);
+	return n < 0 ? 1 : 0;
+}
+
+static const char *find_trigger(const char *arg)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(triggers) / sizeof(triggers[0]); i++) {
+		if (!strcmp(arg, triggers[i])) return triggers[i];
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *trigger = NULL;
+	char *batch;
+	size_t len = 0, size = 1;
+	int i, ret = 0;
+
+	if (argc < 2) return show_config();
+
+	for (i = 1; i < argc; i++) size += strlen(argv[i]) + 1;
+	batch = malloc(size);
+	if (!batch) return 1;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			usage(argv[0]);
+			goto out;
+		}
+		if (strchr(argv[i], '=')) {
+			len += sprintf(batch + len, "%s%s", len ? " " : "", argv[i]);
+		} else if (!trigger && (trigger = find_trigger(argv[i]))) {
+			continue;
+		} else {
+			usage(argv[0]);
+			ret = 2;
+			goto out;
+		}
+	}
+
+	if (len && write_file("config", batch, len)) ret = 1;
+	else if (trigger && write_file(trigger, "1", 1)) ret = 1;
+out:
+	free(batch);
+	return ret;
+}